@@ -0,0 +1,65 @@
+// Contains a bump allocator for parse-time objects. A parse session carves
+// all its AST nodes out of large reusable blocks; reset() rewinds to the
+// start without freeing, so compiling line after line stops exercising the
+// global allocator entirely once the blocks are warm.
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+class Arena {
+private:
+	static constexpr size_t defaultBlockSize = 64 * 1024;
+
+	class Block {
+	public:
+		unique_ptr<char[]> data;
+		size_t capacity;
+
+		Block(size_t capacity) :data(make_unique<char[]>(capacity)), capacity(capacity) {}
+	};
+
+	vector<Block> blocks;
+	size_t blockIndex;
+	size_t used;
+
+	char* allocate(size_t size, size_t align) {
+		while (true) {
+			if (blockIndex < blocks.size()) {
+				size_t aligned = (used + align - 1) & ~(align - 1);
+				if (aligned + size <= blocks[blockIndex].capacity) {
+					used = aligned + size;
+					return blocks[blockIndex].data.get() + aligned;
+				}
+				++blockIndex;
+				used = 0;
+			}
+			else {
+				blocks.emplace_back(max(defaultBlockSize, size + align));
+			}
+		}
+	}
+
+public:
+	Arena() :blockIndex(0), used(0) {}
+
+	// Constructs a T inside the arena. Arena memory is never destructed
+	// individually, so only trivially destructible types are allowed.
+	template <typename T, typename... Args>
+	T* create(Args&&... args) {
+		static_assert(is_trivially_destructible<T>::value,
+			"Arena objects are freed wholesale and must not need destructors");
+		return new (allocate(sizeof(T), alignof(T))) T(forward<Args>(args)...);
+	}
+
+	// Rewinds the arena to empty while keeping its blocks for reuse.
+	// Everything previously created becomes invalid.
+	void reset() {
+		blockIndex = 0;
+		used = 0;
+	}
+};
@@ -0,0 +1,245 @@
+/*
+ Benchmark harness for the calculator. Times tokenization, compilation and
+ evaluation separately over generated workloads (long operator chains, deep
+ nesting, variable-heavy expressions) and reports ns/token and
+ expressions/sec, so performance regressions in any one stage are visible
+ before they ship.
+
+ Build as the CalculatorBench project in Calculator.sln.
+ */
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <chrono>
+#include "tokenStream.h"
+#include "lineTokenizer.h"
+#include "variable.h"
+#include "compiledExpression.h"
+#include "bytecode.h"
+#include "vectorEval.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// Calls fn repeatedly until roughly the given time budget has elapsed and
+// returns the average time of one call in nanoseconds
+template <typename Fn>
+double measureNs(Fn fn, double budgetSeconds = 0.5) {
+	long long iterations = 0;
+	steady_clock::time_point start = steady_clock::now();
+	double elapsed = 0.0;
+
+	do {
+		fn();
+		++iterations;
+		elapsed = duration<double>(steady_clock::now() - start).count();
+	} while (elapsed < budgetSeconds);
+
+	return elapsed * 1e9 / iterations;
+}
+
+// Generates a long flat chain like "1.5+2.5+3.5+..." with n operands
+string makeLongChain(int n) {
+	ostringstream out;
+	for (int i = 0; i < n; ++i) {
+		if (i > 0) {
+			out << (i % 2 == 0 ? '+' : '-');
+		}
+		out << i << ".5";
+	}
+	return out.str();
+}
+
+// Generates a line that is almost entirely numeric literals, the dominant
+// token kind in production inputs, to isolate literal-parsing cost
+string makeNumberHeavy(int n) {
+	ostringstream out;
+	for (int i = 0; i < n; ++i) {
+		if (i > 0) {
+			out << '+';
+		}
+		out << i << '.' << (i % 1000) << "e" << (i % 7 - 3);
+	}
+	return out.str();
+}
+
+// Generates a chain cycling through all five operators, the worst case for
+// the central dispatch branch of the VM
+string makeMixedChain(int n) {
+	const char operators[] = { '+', '-', '*', '/', '%' };
+	ostringstream out;
+	out << "x";
+	for (int i = 1; i < n; ++i) {
+		out << operators[i % 5] << (3.5 + i % 11);
+	}
+	return out.str();
+}
+
+// Generates a deeply parenthesized expression with the given nesting depth
+string makeDeepNesting(int depth) {
+	string out;
+	for (int i = 0; i < depth; ++i) {
+		out += '(';
+	}
+	out += "1+2";
+	for (int i = 0; i < depth; ++i) {
+		out += ')';
+	}
+	return out;
+}
+
+// Generates an expression referencing n distinct variables, e.g.
+// "v0+v1*v2+v3*v4+...", and defines all of them in the given table
+string makeVariableHeavy(int n, VarTable& varTable) {
+	ostringstream out;
+	for (int i = 0; i < n; ++i) {
+		string name = "v" + to_string(i);
+		varTable.define(name, i * 0.25);
+		if (i > 0) {
+			out << (i % 2 == 0 ? '+' : '*');
+		}
+		out << name;
+	}
+	return out.str();
+}
+
+// Counts the tokens in the input to normalize per-token timings
+long long countTokens(const string& input) {
+	NameInterner interner;
+	LineTokenizer tokenizer(input, interner);
+	long long count = 0;
+	while (tokenizer.get().kind != TokenType::INPUT_EOF) {
+		++count;
+	}
+	return count;
+}
+
+// Times both tokenizer front ends over the input
+void benchTokenize(const string& label, const string& input) {
+	long long tokens = countTokens(input);
+	NameInterner interner;
+
+	double streamNs = measureNs([&] {
+		istringstream sstream(input);
+		TokenStream tstream(sstream, interner);
+		while (tstream.get().kind != TokenType::INPUT_EOF) { }
+	});
+
+	double lineNs = measureNs([&] {
+		LineTokenizer tokenizer(input, interner);
+		while (tokenizer.get().kind != TokenType::INPUT_EOF) { }
+	});
+
+	cout << label << ": TokenStream " << streamNs / tokens << " ns/token, "
+		<< "LineTokenizer " << lineNs / tokens << " ns/token" << endl;
+}
+
+// Times compilation (parse to AST) of the input
+void benchCompile(const string& label, const string& input, NameInterner& interner) {
+	Arena arena;
+	double ns = measureNs([&] {
+		arena.reset();
+		LineTokenizer tokenizer(input, interner);
+		ExpressionCompiler{ arena }.compile(tokenizer);
+	});
+
+	cout << label << ": compile " << ns << " ns/expression ("
+		<< 1e9 / ns << " expressions/sec)" << endl;
+}
+
+// Times repeated evaluation of the input compiled once, both as a tree walk
+// and as a lowered bytecode program
+void benchEval(const string& label, const string& input, VarTable& varTable) {
+	LineTokenizer tokenizer(input, varTable.getInterner());
+	Arena arena;
+	CompiledExpression compiled = ExpressionCompiler{ arena }.compile(tokenizer);
+	BytecodeProgram program = BytecodeCompiler{}.compile(compiled);
+
+	double astNs = measureNs([&] {
+		compiled.eval(varTable);
+	});
+
+	double vmNs = measureNs([&] {
+		program.eval(varTable);
+	});
+
+	cout << label << ": AST " << astNs << " ns, bytecode " << vmNs << " ns ("
+		<< 1e9 / vmNs << " expressions/sec)" << endl;
+}
+
+// Times evaluating one formula against many rows of column data, scalar VM
+// row-by-row versus the batched interpreter
+void benchBatchEval(const string& label, const string& input, size_t rows) {
+	VarTable varTable;
+	int base = varTable.getInterner().intern("base");
+	int rate = varTable.getInterner().intern("rate");
+	LineTokenizer tokenizer(input, varTable.getInterner());
+	Arena arena;
+	CompiledExpression compiled = ExpressionCompiler{ arena }.compile(tokenizer);
+	BytecodeProgram program = BytecodeCompiler{}.compile(compiled);
+
+	ColumnTable columns(rows);
+	vector<double> baseValues(rows), rateValues(rows);
+	for (size_t i = 0; i < rows; ++i) {
+		baseValues[i] = 100.0 + (i % 97);
+		rateValues[i] = 0.0001 * (i % 31);
+	}
+	columns.setColumn(base, baseValues);
+	columns.setColumn(rate, rateValues);
+	vector<double> results(rows);
+
+	double scalarNs = measureNs([&] {
+		for (size_t i = 0; i < rows; ++i) {
+			varTable.define(base, baseValues[i]);
+			varTable.define(rate, rateValues[i]);
+			results[i] = program.eval(varTable);
+		}
+	});
+
+	double batchNs = measureNs([&] {
+		evalBatch(program, columns, results.data());
+	});
+
+	cout << label << ": scalar " << scalarNs / rows << " ns/row, batched "
+		<< batchNs / rows << " ns/row" << endl;
+}
+
+int main() {
+	VarTable varTable;
+	varTable.define("x", 2.5);
+
+#if defined(CALC_THREADED_DISPATCH) && defined(__GNUC__)
+	cout << "VM dispatch: threaded (computed goto)" << endl;
+#else
+	cout << "VM dispatch: switch" << endl;
+#endif
+
+	string longChain = makeLongChain(1000);
+	string numberHeavy = makeNumberHeavy(1000);
+	string deepNesting = makeDeepNesting(200);
+	string variableHeavy = makeVariableHeavy(500, varTable);
+
+	cout << "Tokenization:" << endl;
+	benchTokenize("  long chain (1000 operands)", longChain);
+	benchTokenize("  number heavy (1000 literals)", numberHeavy);
+	benchTokenize("  deep nesting (depth 200)", deepNesting);
+	benchTokenize("  variable heavy (500 vars)", variableHeavy);
+
+	cout << endl << "Compilation:" << endl;
+	benchCompile("  long chain (1000 operands)", longChain, varTable.getInterner());
+	benchCompile("  deep nesting (depth 200)", deepNesting, varTable.getInterner());
+	benchCompile("  variable heavy (500 vars)", variableHeavy, varTable.getInterner());
+
+	cout << endl << "Evaluation (compiled once):" << endl;
+	benchEval("  long chain (1000 operands)", longChain, varTable);
+	benchEval("  mixed operators (1000 ops)", makeMixedChain(1000), varTable);
+	benchEval("  deep nesting (depth 200)", deepNesting, varTable);
+	benchEval("  variable heavy (500 vars)", variableHeavy, varTable);
+
+	cout << endl << "Batched evaluation (100k rows):" << endl;
+	benchBatchEval("  base * (1 + rate)", "base * (1 + rate)", 100000);
+	benchBatchEval("  sqrt(base) * rate", "sqrt(base) * rate", 100000);
+
+	return 0;
+}
@@ -0,0 +1,76 @@
+// Contains the opt-in binary result stream for batch mode. Instead of
+// formatting every result to text (which the downstream consumer parses
+// straight back into a double), results are written as raw little-endian
+// doubles behind a small framing header, through a large buffer that is
+// flushed only when full. An optional sidecar stream records the input line
+// index of each emitted result (same order, same count), so consumers can
+// map results back to lines even when some lines failed and produced no
+// value. Values are written in host byte order; every supported target is
+// little-endian.
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+
+using namespace std;
+
+const char binaryResultMagic[4] = { 'C', 'R', 'E', 'S' };
+const char binaryIndexMagic[4] = { 'C', 'I', 'D', 'X' };
+const uint32_t binaryResultVersion = 1;
+
+class BinaryResultWriter {
+private:
+	static const size_t bufferLimit = 1 << 20;
+
+	ostream& output;
+	ostream* index;
+	string outputBuffer;
+	string indexBuffer;
+
+	void writeHeader(string& buffer, const char magic[4]) {
+		buffer.append(magic, 4);
+		buffer.append(reinterpret_cast<const char*>(&binaryResultVersion),
+			sizeof(binaryResultVersion));
+	}
+
+public:
+	// index may be null when no sidecar is wanted
+	BinaryResultWriter(ostream& output, ostream* index)
+		:output(output), index(index) {
+		writeHeader(outputBuffer, binaryResultMagic);
+		if (index != nullptr) {
+			writeHeader(indexBuffer, binaryIndexMagic);
+		}
+	}
+
+	// Appends one result; line is the zero-based input line it came from
+	void append(uint32_t line, double value) {
+		outputBuffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+		if (outputBuffer.size() >= bufferLimit) {
+			output.write(outputBuffer.data(), outputBuffer.size());
+			outputBuffer.clear();
+		}
+
+		if (index != nullptr) {
+			indexBuffer.append(reinterpret_cast<const char*>(&line), sizeof(line));
+			if (indexBuffer.size() >= bufferLimit) {
+				index->write(indexBuffer.data(), indexBuffer.size());
+				indexBuffer.clear();
+			}
+		}
+	}
+
+	// Flushes everything still buffered; call once at the end of the run
+	void finish() {
+		output.write(outputBuffer.data(), outputBuffer.size());
+		outputBuffer.clear();
+		output.flush();
+
+		if (index != nullptr) {
+			index->write(indexBuffer.data(), indexBuffer.size());
+			indexBuffer.clear();
+			index->flush();
+		}
+	}
+};
@@ -0,0 +1,288 @@
+// Contains a stack-based bytecode backend for compiled expressions. The AST
+// from compiledExpression.h is lowered once into a flat array of
+// instructions executed by a dispatch loop over a contiguous value stack, so
+// repeated evaluation walks sequential memory instead of chasing node
+// pointers through the heap.
+#pragma once
+#include <cstdint>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include "compiledExpression.h"
+#include "functionRegistry.h"
+#include "variable.h"
+
+using namespace std;
+
+enum class OpCode : uint8_t {
+	PUSH_CONST,		// push constants[operand]
+	LOAD_VAR,		// push the value of variable with symbol ID 'operand'
+	ADD,
+	SUB,
+	MUL,
+	DIV,
+	MOD,
+	NEG,
+	CALL_FN			// call functionTable[operand] on the top 'arity' values
+};
+
+// One fixed-width instruction; the operand is a constant-pool index for
+// PUSH_CONST, a symbol ID for LOAD_VAR and a functionTable index for
+// CALL_FN, unused otherwise
+class Instruction {
+public:
+	OpCode op;
+	int operand;
+
+	Instruction(OpCode op) :op(op), operand(0) {}
+	Instruction(OpCode op, int operand) :op(op), operand(operand) {}
+};
+
+// A flat, contiguously stored program evaluating one expression. Built from
+// an AST with BytecodeCompiler; eval() runs it against a variable table.
+//
+// Defining CALC_THREADED_DISPATCH switches eval() from the switch loop to
+// threaded dispatch using labels-as-values (each handler jumps straight to
+// the next instruction's handler), which spreads the dispatch branch over
+// per-opcode sites and predicts much better on operator-dense programs.
+// Computed goto is a GCC/Clang extension; MSVC builds always take the
+// switch loop.
+class BytecodeProgram {
+	friend class BytecodeCompiler;
+	friend class ExpressionLibrary;
+
+private:
+	vector<Instruction> code;
+	vector<double> constants;
+
+	// deepest value-stack use of the program, known exactly after lowering
+	int maxStack = 0;
+
+public:
+	// varTable is any type with VarTable's read interface (e.g. a
+	// ConcurrentVarTable::Snapshot)
+	template <typename VT>
+	double eval(const VT& varTable) const {
+		// the common case fits into a small stack kept off the heap
+		double fixedStack[64];
+		vector<double> largeStack;
+		double* stack = fixedStack;
+		if (maxStack > 64) {
+			largeStack.resize(maxStack);
+			stack = largeStack.data();
+		}
+
+		int top = 0;
+
+		// an empty program has no first instruction to dispatch to; it only
+		// arises from external inputs (e.g. a corrupt library blob)
+		if (code.empty()) {
+			return 0.0;
+		}
+
+#if defined(CALC_THREADED_DISPATCH) && defined(__GNUC__)
+		// must line up with the OpCode enumerators
+		static const void* const labels[] = {
+			&&opPushConst, &&opLoadVar, &&opAdd, &&opSub, &&opMul,
+			&&opDiv, &&opMod, &&opNeg, &&opCallFn
+		};
+		const Instruction* instrs = code.data();
+		const size_t count = code.size();
+		size_t ip = 0;
+
+#define CALC_NEXT() do { if (++ip == count) goto opDone; \
+		goto *labels[static_cast<int>(instrs[ip].op)]; } while (0)
+
+		goto *labels[static_cast<int>(instrs[0].op)];
+
+	opPushConst:
+		stack[top++] = constants[instrs[ip].operand];
+		CALC_NEXT();
+	opLoadVar:
+		stack[top++] = varTable.get(instrs[ip].operand);
+		CALC_NEXT();
+	opAdd:
+		--top;
+		stack[top - 1] += stack[top];
+		CALC_NEXT();
+	opSub:
+		--top;
+		stack[top - 1] -= stack[top];
+		CALC_NEXT();
+	opMul:
+		--top;
+		stack[top - 1] *= stack[top];
+		CALC_NEXT();
+	opDiv:
+		--top;
+		if (stack[top] == 0.0) {
+			throw runtime_error("Division by zero");
+		}
+		stack[top - 1] /= stack[top];
+		CALC_NEXT();
+	opMod:
+		--top;
+		if (stack[top] == 0.0) {
+			throw runtime_error("Division by zero");
+		}
+		stack[top - 1] = fmod(stack[top - 1], stack[top]);
+		CALC_NEXT();
+	opNeg:
+		stack[top - 1] = -stack[top - 1];
+		CALC_NEXT();
+	opCallFn: {
+		const FunctionInfo& info = functionTable[instrs[ip].operand];
+		if (info.arity == 2) {
+			--top;
+			stack[top - 1] = info.binary(stack[top - 1], stack[top]);
+		}
+		else {
+			stack[top - 1] = info.unary(stack[top - 1]);
+		}
+		CALC_NEXT();
+	}
+	opDone:
+#undef CALC_NEXT
+
+#else
+		for (const Instruction& instr : code) {
+			switch (instr.op) {
+			case OpCode::PUSH_CONST:
+				stack[top++] = constants[instr.operand];
+				break;
+			case OpCode::LOAD_VAR:
+				stack[top++] = varTable.get(instr.operand);
+				break;
+			case OpCode::ADD:
+				--top;
+				stack[top - 1] += stack[top];
+				break;
+			case OpCode::SUB:
+				--top;
+				stack[top - 1] -= stack[top];
+				break;
+			case OpCode::MUL:
+				--top;
+				stack[top - 1] *= stack[top];
+				break;
+			case OpCode::DIV:
+				--top;
+				if (stack[top] == 0.0) {
+					throw runtime_error("Division by zero");
+				}
+				stack[top - 1] /= stack[top];
+				break;
+			case OpCode::MOD:
+				--top;
+				if (stack[top] == 0.0) {
+					throw runtime_error("Division by zero");
+				}
+				stack[top - 1] = fmod(stack[top - 1], stack[top]);
+				break;
+			case OpCode::NEG:
+				stack[top - 1] = -stack[top - 1];
+				break;
+			case OpCode::CALL_FN: {
+				const FunctionInfo& info = functionTable[instr.operand];
+				if (info.arity == 2) {
+					--top;
+					stack[top - 1] = info.binary(stack[top - 1], stack[top]);
+				}
+				else {
+					stack[top - 1] = info.unary(stack[top - 1]);
+				}
+				break;
+			}
+			}
+		}
+#endif
+
+		return stack[0];
+	}
+
+	size_t instructionCount() const {
+		return code.size();
+	}
+
+	// Read access for alternative interpreters (e.g. the batched SIMD one
+	// in vectorEval.h)
+	const vector<Instruction>& instructions() const {
+		return code;
+	}
+
+	const vector<double>& constantPool() const {
+		return constants;
+	}
+
+	int maxStackDepth() const {
+		return maxStack;
+	}
+};
+
+// Lowers an expression AST into a BytecodeProgram by a post-order walk.
+class BytecodeCompiler {
+private:
+	BytecodeProgram program;
+	int stackDepth = 0;
+
+	void emit(Instruction instr, int stackEffect) {
+		program.code.push_back(instr);
+		stackDepth += stackEffect;
+		if (stackDepth > program.maxStack) {
+			program.maxStack = stackDepth;
+		}
+	}
+
+	void lower(const ExprNode& node) {
+		switch (node.type) {
+		case ExprNodeType::NUMBER:
+			program.constants.push_back(node.value);
+			emit(Instruction{ OpCode::PUSH_CONST,
+				static_cast<int>(program.constants.size()) - 1 }, 1);
+			break;
+		case ExprNodeType::VARIABLE:
+			emit(Instruction{ OpCode::LOAD_VAR, node.symbol }, 1);
+			break;
+		case ExprNodeType::ADD:
+		case ExprNodeType::SUB:
+		case ExprNodeType::MUL:
+		case ExprNodeType::DIV:
+		case ExprNodeType::MOD:
+			lower(*node.left);
+			lower(*node.right);
+			emit(Instruction{ binaryOp(node.type) }, -1);
+			break;
+		case ExprNodeType::NEG:
+			lower(*node.left);
+			emit(Instruction{ OpCode::NEG }, 0);
+			break;
+		case ExprNodeType::CALL: {
+			lower(*node.left);
+			int arity = functionTable[node.symbol].arity;
+			if (arity == 2) {
+				lower(*node.right);
+			}
+			emit(Instruction{ OpCode::CALL_FN, node.symbol }, arity == 2 ? -1 : 0);
+			break;
+		}
+		}
+	}
+
+	static OpCode binaryOp(ExprNodeType type) {
+		switch (type) {
+		case ExprNodeType::ADD: return OpCode::ADD;
+		case ExprNodeType::SUB: return OpCode::SUB;
+		case ExprNodeType::MUL: return OpCode::MUL;
+		case ExprNodeType::DIV: return OpCode::DIV;
+		default: return OpCode::MOD;
+		}
+	}
+
+public:
+	// Lowers the compiled expression to a flat bytecode program
+	BytecodeProgram compile(const CompiledExpression& expr) {
+		lower(expr.getRoot());
+		return move(program);
+	}
+};
@@ -0,0 +1,318 @@
+// Contains an exception-free evaluation path. Malformed input is reported as
+// a compact error code plus the source position it was detected at, instead
+// of a thrown runtime_error with a concatenated message, so a bad line costs
+// no unwinding and no string building on the way out.
+#pragma once
+#include <cstddef>
+#include <cmath>
+
+#include "functionRegistry.h"
+#include "lineTokenizer.h"
+#include "variable.h"
+
+using namespace std;
+
+// Everything that can go wrong while scanning or evaluating a statement.
+// Mirrors the runtime_error messages of the throwing path, except that the
+// function-call errors name no particular function - the descriptions stay
+// static strings with nothing built on the error path.
+enum class EvalError {
+	NONE,
+	UNEXPECTED_TOKEN,
+	EXPECTED_PRIMARY,
+	MISSING_RPAREN,
+	EXPECTED_LPAREN_IN_CALL,
+	MISSING_COMMA_IN_CALL,
+	MISSING_RPAREN_IN_CALL,
+	NEGATIVE_SQRT_ARGUMENT,
+	DIVISION_BY_ZERO,
+	UNDEFINED_VARIABLE,
+	EXPECTED_NAME_AFTER_LET,
+	MISSING_EQUALS_IN_DECLARATION
+};
+
+// Returns a static description of the error; nothing is allocated or built
+inline const char* describeEvalError(EvalError error) {
+	switch (error) {
+	case EvalError::NONE:
+		return "No error";
+	case EvalError::UNEXPECTED_TOKEN:
+		return "Unexpected token.";
+	case EvalError::EXPECTED_PRIMARY:
+		return "Expected a primary";
+	case EvalError::MISSING_RPAREN:
+		return "Missing a right parenthesis.";
+	case EvalError::EXPECTED_LPAREN_IN_CALL:
+		return "Expected '(' after a function name";
+	case EvalError::MISSING_COMMA_IN_CALL:
+		return "Expected ',' between the arguments of a function.";
+	case EvalError::MISSING_RPAREN_IN_CALL:
+		return "Expected ')' after the arguments of a function.";
+	case EvalError::NEGATIVE_SQRT_ARGUMENT:
+		return "Argument of 'sqrt' function must not be negative.";
+	case EvalError::DIVISION_BY_ZERO:
+		return "Division by zero";
+	case EvalError::UNDEFINED_VARIABLE:
+		return "Undefined variable";
+	case EvalError::EXPECTED_NAME_AFTER_LET:
+		return "Expected a variable name after 'let' keyword.";
+	case EvalError::MISSING_EQUALS_IN_DECLARATION:
+		return "Missing '=' in a declaration";
+	}
+
+	return "Unknown error";
+}
+
+// Value-or-error result of the exception-free evaluation path
+class EvalResult {
+public:
+	double value;
+	EvalError error;
+
+	// character offset in the line at which the error was detected
+	size_t position;
+
+	static EvalResult ok(double value) {
+		EvalResult result;
+		result.value = value;
+		result.error = EvalError::NONE;
+		result.position = 0;
+		return result;
+	}
+
+	static EvalResult failure(EvalError error, size_t position) {
+		EvalResult result;
+		result.value = 0.0;
+		result.error = error;
+		result.position = position;
+		return result;
+	}
+
+	bool hasValue() const {
+		return error == EvalError::NONE;
+	}
+};
+
+// Single-pass evaluator mirroring expression()/term()/primary() in main.cpp,
+// but with bool returns and an error code instead of exceptions. The happy
+// path contains no try/throw at all.
+class CheckedEvaluator {
+private:
+	LineTokenizer& ts;
+	VarTable& varTable;
+	EvalError error;
+	size_t errorPos;
+
+	// Records the first error with the current cursor position; always
+	// returns false so that call sites can 'return fail(...)'
+	bool fail(EvalError e) {
+		if (error == EvalError::NONE) {
+			error = e;
+			errorPos = ts.position();
+		}
+		return false;
+	}
+
+	// handles 'primary ->' production rules
+	bool primary(double& out) {
+		Token token = ts.tryGet();
+		switch (token.kind) {
+		case TokenType::ADD:
+			return primary(out);
+		case TokenType::SUB:
+			if (!primary(out)) {
+				return false;
+			}
+			out = -out;
+			return true;
+		case TokenType::LPAREN:
+			if (!expression(out)) {
+				return false;
+			}
+			if (ts.tryGet().kind != TokenType::RPAREN) {
+				return fail(EvalError::MISSING_RPAREN);
+			}
+			return true;
+		case TokenType::NUMBER:
+			out = token.value;
+			return true;
+		case TokenType::NAME:
+			if (!varTable.tryGet(token.symbol, out)) {
+				return fail(EvalError::UNDEFINED_VARIABLE);
+			}
+			return true;
+		case TokenType::FUNC: {
+			const FunctionInfo& info = functionTable[token.symbol];
+			if (ts.tryGet().kind != TokenType::LPAREN) {
+				return fail(EvalError::EXPECTED_LPAREN_IN_CALL);
+			}
+			double first;
+			if (!expression(first)) {
+				return false;
+			}
+			double second = 0.0;
+			if (info.arity == 2) {
+				if (ts.tryGet().kind != TokenType::COMMA) {
+					return fail(EvalError::MISSING_COMMA_IN_CALL);
+				}
+				if (!expression(second)) {
+					return false;
+				}
+			}
+			if (ts.tryGet().kind != TokenType::RPAREN) {
+				return fail(EvalError::MISSING_RPAREN_IN_CALL);
+			}
+
+			// the registered sqrt throws on a negative argument; this path
+			// must not, so the domain check happens here
+			if (token.symbol == FUNC_SQRT && first < 0.0) {
+				return fail(EvalError::NEGATIVE_SQRT_ARGUMENT);
+			}
+			out = info.arity == 2 ? info.binary(first, second) : info.unary(first);
+			return true;
+		}
+		case TokenType::UNKNOWN:
+			return fail(EvalError::UNEXPECTED_TOKEN);
+		default:
+			ts.putback(token);
+			return fail(EvalError::EXPECTED_PRIMARY);
+		}
+	}
+
+	// handles 'term ->' production rules
+	bool term(double& out) {
+		if (!primary(out)) {
+			return false;
+		}
+		Token token = ts.tryGet();
+		while (true) {
+			switch (token.kind) {
+			case TokenType::MUL: {
+				double right;
+				if (!primary(right)) {
+					return false;
+				}
+				out *= right;
+				token = ts.tryGet();
+				break;
+			}
+			case TokenType::DIV: {
+				double right;
+				if (!primary(right)) {
+					return false;
+				}
+				if (right == 0.0) {
+					return fail(EvalError::DIVISION_BY_ZERO);
+				}
+				out /= right;
+				token = ts.tryGet();
+				break;
+			}
+			case TokenType::MOD: {
+				double right;
+				if (!primary(right)) {
+					return false;
+				}
+				if (right == 0.0) {
+					return fail(EvalError::DIVISION_BY_ZERO);
+				}
+				out = fmod(out, right);
+				token = ts.tryGet();
+				break;
+			}
+			case TokenType::UNKNOWN:
+				return fail(EvalError::UNEXPECTED_TOKEN);
+			default:
+				ts.putback(token);
+				return true;
+			}
+		}
+	}
+
+	// handles 'expression ->' production rules
+	bool expression(double& out) {
+		if (!term(out)) {
+			return false;
+		}
+		Token token = ts.tryGet();
+		while (true) {
+			switch (token.kind) {
+			case TokenType::ADD: {
+				double right;
+				if (!term(right)) {
+					return false;
+				}
+				out += right;
+				token = ts.tryGet();
+				break;
+			}
+			case TokenType::SUB: {
+				double right;
+				if (!term(right)) {
+					return false;
+				}
+				out -= right;
+				token = ts.tryGet();
+				break;
+			}
+			case TokenType::UNKNOWN:
+				return fail(EvalError::UNEXPECTED_TOKEN);
+			default:
+				ts.putback(token);
+				return true;
+			}
+		}
+	}
+
+	// handles 'declaration ->' production rule
+	bool declaration(double& out) {
+		Token token = ts.tryGet();
+		if (token.kind != TokenType::NAME) {
+			return fail(EvalError::EXPECTED_NAME_AFTER_LET);
+		}
+		int symbol = token.symbol;
+
+		if (ts.tryGet().kind != TokenType::EQUALS) {
+			return fail(EvalError::MISSING_EQUALS_IN_DECLARATION);
+		}
+
+		if (!expression(out)) {
+			return false;
+		}
+		varTable.define(symbol, out);
+		return true;
+	}
+
+	// handles 'statement ->' production rules
+	bool statement(double& out) {
+		Token token = ts.tryGet();
+		if (token.kind == TokenType::KW_LET) {
+			return declaration(out);
+		}
+		ts.putback(token);
+		return expression(out);
+	}
+
+public:
+	CheckedEvaluator(LineTokenizer& ts, VarTable& varTable)
+		:ts(ts), varTable(varTable), error(EvalError::NONE), errorPos(0) {}
+
+	// Evaluates all statements on the line, mirroring calculation() in
+	// main.cpp, and returns the last value or the first error
+	EvalResult run() {
+		double result = 0.0;
+		while (true) {
+			Token token = ts.tryGet();
+			if (token.kind == TokenType::INPUT_EOF) {
+				break;
+			}
+			ts.putback(token);
+
+			if (!statement(result)) {
+				return EvalResult::failure(error, errorPos);
+			}
+		}
+
+		return EvalResult::ok(result);
+	}
+};
@@ -0,0 +1,380 @@
+// Contains a compiled (parse-once, evaluate-many-times) representation of an expression.
+#pragma once
+#include <cmath>
+#include "arena.h"
+#include "functionRegistry.h"
+#include "tokenStream.h"
+#include "variable.h"
+
+using namespace std;
+
+// Kind of an AST node. Mirrors the grammar productions handled by
+// expression(), term() and primary() in main.cpp.
+enum class ExprNodeType {
+	NUMBER,
+	VARIABLE,
+	ADD,
+	SUB,
+	MUL,
+	DIV,
+	MOD,
+	NEG,
+	CALL
+};
+
+// A single node of the expression AST. Leaf nodes (NUMBER, VARIABLE) have no
+// children; NEG and unary CALLs use only the left child. Nodes live in the
+// Arena of the parse session that built them and are never freed
+// individually.
+class ExprNode {
+public:
+	ExprNodeType type;
+	double value;
+
+	// interned ID of a VARIABLE node, or the functionTable index of a CALL
+	int symbol;
+
+	ExprNode* left;
+	ExprNode* right;
+
+	ExprNode(double value)
+		:type(ExprNodeType::NUMBER), value(value), symbol(-1), left(nullptr), right(nullptr) {}
+
+	ExprNode(ExprNodeType type, int symbol)
+		:type(type), value(0.0), symbol(symbol), left(nullptr), right(nullptr) {}
+
+	ExprNode(ExprNodeType type, ExprNode* left, ExprNode* right)
+		:type(type), value(0.0), symbol(-1), left(left), right(right) {}
+
+	ExprNode(ExprNodeType type, int symbol, ExprNode* left, ExprNode* right)
+		:type(type), value(0.0), symbol(symbol), left(left), right(right) {}
+};
+
+// An expression parsed into an AST once, evaluated repeatedly against
+// different variable bindings with eval(). The nodes are borrowed from the
+// compiler's arena, which must outlive the expression.
+class CompiledExpression {
+private:
+	const ExprNode* root;
+
+	template <typename VT>
+	double evalNode(const ExprNode& node, const VT& varTable) const {
+		switch (node.type) {
+		case ExprNodeType::NUMBER:
+			return node.value;
+		case ExprNodeType::VARIABLE:
+			return varTable.get(node.symbol);
+		case ExprNodeType::ADD:
+			return evalNode(*node.left, varTable) + evalNode(*node.right, varTable);
+		case ExprNodeType::SUB:
+			return evalNode(*node.left, varTable) - evalNode(*node.right, varTable);
+		case ExprNodeType::MUL:
+			return evalNode(*node.left, varTable) * evalNode(*node.right, varTable);
+		case ExprNodeType::DIV: {
+			double right = evalNode(*node.right, varTable);
+			if (right == 0.0) {
+				throw runtime_error("Division by zero");
+			}
+			return evalNode(*node.left, varTable) / right;
+		}
+		case ExprNodeType::MOD: {
+			double right = evalNode(*node.right, varTable);
+			if (right == 0.0) {
+				throw runtime_error("Division by zero");
+			}
+			return fmod(evalNode(*node.left, varTable), right);
+		}
+		case ExprNodeType::NEG:
+			return -evalNode(*node.left, varTable);
+		case ExprNodeType::CALL: {
+			const FunctionInfo& info = functionTable[node.symbol];
+			double first = evalNode(*node.left, varTable);
+			if (info.arity == 2) {
+				return info.binary(first, evalNode(*node.right, varTable));
+			}
+			return info.unary(first);
+		}
+		}
+
+		return 0.0;
+	}
+
+	int countNodes(const ExprNode& node) const {
+		int count = 1;
+		if (node.left != nullptr) {
+			count += countNodes(*node.left);
+		}
+		if (node.right != nullptr) {
+			count += countNodes(*node.right);
+		}
+		return count;
+	}
+
+public:
+	CompiledExpression(const ExprNode* root) :root(root) {}
+
+	// Evaluates the expression against the given variable bindings: a
+	// VarTable, or any type with the same read interface (e.g. a
+	// ConcurrentVarTable::Snapshot).
+	template <typename VT>
+	double eval(const VT& varTable) const {
+		return evalNode(*root, varTable);
+	}
+
+	// Returns the number of AST nodes; useful for checking how much of the
+	// expression was folded away at compile time
+	int nodeCount() const {
+		return countNodes(*root);
+	}
+
+	// Grants backends (e.g. the bytecode lowering in bytecode.h) read access
+	// to the AST
+	const ExprNode& getRoot() const {
+		return *root;
+	}
+};
+
+// A whole compiled statement: either a plain expression, or a 'let'
+// declaration that also defines a variable when evaluated.
+class CompiledStatement {
+public:
+	// symbol the statement defines via 'let', or -1 for a plain expression
+	int defineSymbol;
+	CompiledExpression expr;
+
+	CompiledStatement(int defineSymbol, CompiledExpression expr)
+		:defineSymbol(defineSymbol), expr(move(expr)) {}
+
+	// Evaluates the statement, storing the value into the table when the
+	// statement is a declaration
+	double eval(VarTable& varTable) const {
+		double value = expr.eval(varTable);
+		if (defineSymbol >= 0) {
+			varTable.define(defineSymbol, value);
+		}
+		return value;
+	}
+};
+
+// Builds a CompiledExpression from a token source. The member functions
+// mirror the single-pass expression(), term() and primary() evaluators in
+// main.cpp, but build AST nodes instead of computing values. Works with any
+// front end providing get()/putback() (TokenStream, LineTokenizer).
+class ExpressionCompiler {
+private:
+	// all nodes are bump-allocated here; reset between parse sessions is
+	// the owner's choice
+	Arena& arena;
+
+	// Creates a node for the given operation, folding it into a single
+	// NUMBER node right away when all operands are already constant. The
+	// checks mirror the evaluation-time ones, so errors in constant
+	// subexpressions (division by zero, sqrt of a negative number) are
+	// reported at compile time with the same messages.
+	ExprNode* makeNode(ExprNodeType type, ExprNode* left, ExprNode* right) {
+		bool leftConst = left != nullptr && left->type == ExprNodeType::NUMBER;
+		bool rightConst = right != nullptr && right->type == ExprNodeType::NUMBER;
+
+		switch (type) {
+		case ExprNodeType::ADD:
+			if (leftConst && rightConst) {
+				return arena.create<ExprNode>(left->value + right->value);
+			}
+			break;
+		case ExprNodeType::SUB:
+			if (leftConst && rightConst) {
+				return arena.create<ExprNode>(left->value - right->value);
+			}
+			break;
+		case ExprNodeType::MUL:
+			if (leftConst && rightConst) {
+				return arena.create<ExprNode>(left->value * right->value);
+			}
+			break;
+		case ExprNodeType::DIV:
+			if (leftConst && rightConst) {
+				if (right->value == 0.0) {
+					throw runtime_error("Division by zero");
+				}
+				return arena.create<ExprNode>(left->value / right->value);
+			}
+			break;
+		case ExprNodeType::MOD:
+			if (leftConst && rightConst) {
+				if (right->value == 0.0) {
+					throw runtime_error("Division by zero");
+				}
+				return arena.create<ExprNode>(fmod(left->value, right->value));
+			}
+			break;
+		case ExprNodeType::NEG:
+			if (leftConst) {
+				return arena.create<ExprNode>(-left->value);
+			}
+			break;
+		default:
+			break;
+		}
+
+		return arena.create<ExprNode>(type, left, right);
+	}
+
+	// Creates a CALL node, folding it away when all arguments are already
+	// constant. Folding invokes the registered function, so a domain error in
+	// a constant call (e.g. sqrt of a negative number) is reported at compile
+	// time with the same message as at evaluation time.
+	ExprNode* makeCall(int func, ExprNode* first, ExprNode* second) {
+		const FunctionInfo& info = functionTable[func];
+		bool firstConst = first->type == ExprNodeType::NUMBER;
+
+		if (info.arity == 2) {
+			if (firstConst && second->type == ExprNodeType::NUMBER) {
+				return arena.create<ExprNode>(info.binary(first->value, second->value));
+			}
+		}
+		else if (firstConst) {
+			return arena.create<ExprNode>(info.unary(first->value));
+		}
+
+		return arena.create<ExprNode>(ExprNodeType::CALL, func, first, second);
+	}
+
+	// handles 'primary ->' production rules
+	template <typename TS>
+	ExprNode* primary(TS& ts) {
+		auto token = ts.get();
+		switch (token.kind) {
+		case TokenType::ADD:
+			return primary(ts);
+		case TokenType::SUB:
+			return makeNode(ExprNodeType::NEG, primary(ts), nullptr);
+		case TokenType::LPAREN: {
+			ExprNode* expr = expression(ts);
+			token = ts.get();
+			if (token.kind != TokenType::RPAREN) {
+				throw runtime_error("Missing a right parenthesis.");
+			}
+			return expr;
+		}
+		case TokenType::NUMBER:
+			return arena.create<ExprNode>(token.value);
+		case TokenType::NAME:
+			return arena.create<ExprNode>(ExprNodeType::VARIABLE, token.symbol);
+		case TokenType::FUNC: {
+			const FunctionInfo& info = functionTable[token.symbol];
+			int func = token.symbol;
+			token = ts.get();
+			if (token.kind != TokenType::LPAREN) {
+				throw runtime_error("Expected '(' after function '"
+					+ string(info.name) + "'");
+			}
+			ExprNode* first = expression(ts);
+			ExprNode* second = nullptr;
+			if (info.arity == 2) {
+				token = ts.get();
+				if (token.kind != TokenType::COMMA) {
+					throw runtime_error("Expected ',' between the arguments of '"
+						+ string(info.name) + "' function.");
+				}
+				second = expression(ts);
+			}
+			token = ts.get();
+			if (token.kind != TokenType::RPAREN) {
+				throw runtime_error("Expected ')' after the "
+					+ string(info.arity == 2 ? "arguments" : "argument")
+					+ " of '" + string(info.name) + "' function.");
+			}
+			return makeCall(func, first, second);
+		}
+		default:
+			ts.putback(token);
+			throw runtime_error("Expected a primary");
+		}
+	}
+
+	// handles 'term ->' production rules
+	template <typename TS>
+	ExprNode* term(TS& ts) {
+		ExprNode* left = primary(ts);
+		auto token = ts.get();
+		while (true) {
+			switch (token.kind) {
+			case TokenType::MUL:
+				left = makeNode(ExprNodeType::MUL, left, primary(ts));
+				token = ts.get();
+				break;
+			case TokenType::DIV:
+				left = makeNode(ExprNodeType::DIV, left, primary(ts));
+				token = ts.get();
+				break;
+			case TokenType::MOD:
+				left = makeNode(ExprNodeType::MOD, left, primary(ts));
+				token = ts.get();
+				break;
+			default:
+				ts.putback(token);
+				return left;
+			}
+		}
+	}
+
+	// handles 'expression ->' production rules
+	template <typename TS>
+	ExprNode* expression(TS& ts) {
+		ExprNode* left = term(ts);
+		auto token = ts.get();
+		while (true) {
+			switch (token.kind) {
+			case TokenType::ADD:
+				left = makeNode(ExprNodeType::ADD, left, term(ts));
+				token = ts.get();
+				break;
+			case TokenType::SUB:
+				left = makeNode(ExprNodeType::SUB, left, term(ts));
+				token = ts.get();
+				break;
+			default:
+				ts.putback(token);
+				return left;
+			}
+		}
+	}
+
+public:
+	ExpressionCompiler(Arena& arena) :arena(arena) {}
+
+	// Parses a single expression from the token source into a reusable
+	// CompiledExpression.
+	template <typename TS>
+	CompiledExpression compile(TS& ts) {
+		return CompiledExpression{ expression(ts) };
+	}
+
+	// Parses a whole statement ('let' declaration or expression), mirroring
+	// statement() and declaration() in main.cpp. The interner is needed to
+	// report the declared name in error messages.
+	template <typename TS>
+	CompiledStatement compileStatement(TS& ts, NameInterner& interner) {
+		auto token = ts.get();
+		if (token.kind != TokenType::KW_LET) {
+			ts.putback(token);
+			return CompiledStatement{ -1, compile(ts) };
+		}
+
+		token = ts.get();
+		if (token.kind != TokenType::NAME) {
+			ts.putback(token);
+			throw runtime_error("Expected a variable name after 'let' keyword.");
+		}
+		int symbol = token.symbol;
+
+		token = ts.get();
+		if (token.kind != TokenType::EQUALS) {
+			ts.putback(token);
+			throw runtime_error("Missing '=' in a declaration of '"
+				+ interner.nameOf(symbol) + "'");
+		}
+
+		return CompiledStatement{ symbol, compile(ts) };
+	}
+};
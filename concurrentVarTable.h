@@ -0,0 +1,88 @@
+// Contains a variable table for many concurrent readers sharing one set of
+// bindings. The published value array is immutable: a reader acquires the
+// current version with a single atomic load and then every get() during its
+// evaluation is a plain array access - no lock, no per-read reference count,
+// no contention between evaluations. define() serializes writers on a mutex,
+// copies the array, and publishes the new version copy-on-write; readers
+// holding the old version keep a consistent view until they drop it.
+#pragma once
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "variable.h"
+
+using namespace std;
+
+class ConcurrentVarTable {
+public:
+	// One immutable published version of the bindings. Hold a snapshot for
+	// the duration of one evaluation so all reads see the same version; it
+	// mirrors the read interface of VarTable, so the compiled evaluators
+	// work against it unchanged.
+	class Snapshot {
+		friend class ConcurrentVarTable;
+
+	private:
+		vector<double> values;
+		vector<char> isDefined;
+
+	public:
+		double get(int id) const {
+			if (id < 0 || id >= static_cast<int>(values.size()) || !isDefined[id]) {
+				throw runtime_error("Undefined variable");
+			}
+			return values[id];
+		}
+
+		bool tryGet(int id, double& out) const {
+			if (id < 0 || id >= static_cast<int>(values.size()) || !isDefined[id]) {
+				return false;
+			}
+			out = values[id];
+			return true;
+		}
+	};
+
+private:
+	NameInterner interner;
+	shared_ptr<const Snapshot> current;
+	mutex writeLock;
+
+public:
+	ConcurrentVarTable() :current(make_shared<const Snapshot>()) {}
+
+	// The interner is not concurrent: intern names during setup or from
+	// writer threads only. Readers never touch it - they carry interned IDs.
+	NameInterner& getInterner() {
+		return interner;
+	}
+
+	// Returns the current version of the bindings; one atomic load
+	shared_ptr<const Snapshot> snapshot() const {
+		return atomic_load(&current);
+	}
+
+	// Publishes a new version with the binding changed; writers serialize
+	// here, readers are never blocked
+	double define(int id, double value) {
+		lock_guard<mutex> guard(writeLock);
+
+		shared_ptr<Snapshot> next = make_shared<Snapshot>(*current);
+		if (id >= static_cast<int>(next->values.size())) {
+			next->values.resize(id + 1, 0.0);
+			next->isDefined.resize(id + 1, 0);
+		}
+		next->values[id] = value;
+		next->isDefined[id] = 1;
+
+		atomic_store(&current, shared_ptr<const Snapshot>(move(next)));
+		return value;
+	}
+
+	double define(const string& name, double value) {
+		return define(interner.intern(name), value);
+	}
+};
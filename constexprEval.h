@@ -0,0 +1,252 @@
+// Contains a constexpr re-implementation of the expression grammar, so that
+// formulas fixed at build time fold to plain constants in the binary:
+//
+//     constexpr double r = evalConstant("3*sqrt(2)+1");
+//
+// It mirrors expression()/term()/primary() from main.cpp, but runs over a
+// string_view cursor instead of a tokenizer and supports no variables - a
+// build-time formula has nothing to look up. Errors (malformed input,
+// division by zero, a negative sqrt argument) are throws; in a constant
+// expression a reached throw is a compile error at the offending formula.
+// Only the registry functions computable without libm are available at
+// compile time: sqrt, abs, min and max.
+#pragma once
+#include <stdexcept>
+#include <string_view>
+
+using namespace std;
+
+// Newton-Raphson square root usable in constant expressions; iterates to a
+// fixed point (or a one-ulp two-cycle), which is as close as libm gets
+constexpr double constantSqrt(double x) {
+	if (x < 0.0) {
+		throw runtime_error("Argument of 'sqrt' function must not be negative.");
+	}
+	if (x == 0.0) {
+		return 0.0;
+	}
+
+	double curr = x;
+	double prev = 0.0;
+	double older = 0.0;
+	while (curr != prev && curr != older) {
+		older = prev;
+		prev = curr;
+		curr = 0.5 * (curr + x / curr);
+	}
+	return curr;
+}
+
+class ConstexprEvaluator {
+private:
+	string_view source;
+	size_t pos = 0;
+
+	// the <cctype> classifiers are not constexpr
+	static constexpr bool isDigitChar(char ch) {
+		return ch >= '0' && ch <= '9';
+	}
+
+	static constexpr bool isAlphaChar(char ch) {
+		return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z');
+	}
+
+	constexpr void skipSpace() {
+		while (pos < source.size() && (source[pos] == ' ' || source[pos] == '\t')) {
+			++pos;
+		}
+	}
+
+	// Consumes the given character if it is next (after whitespace)
+	constexpr bool consume(char ch) {
+		skipSpace();
+		if (pos < source.size() && source[pos] == ch) {
+			++pos;
+			return true;
+		}
+		return false;
+	}
+
+	// Parses a floating-point literal at the cursor
+	constexpr double number() {
+		bool anyDigit = false;
+		double value = 0.0;
+		while (pos < source.size() && isDigitChar(source[pos])) {
+			value = value * 10.0 + (source[pos] - '0');
+			++pos;
+			anyDigit = true;
+		}
+
+		if (pos < source.size() && source[pos] == '.') {
+			++pos;
+			double scale = 0.1;
+			while (pos < source.size() && isDigitChar(source[pos])) {
+				value += (source[pos] - '0') * scale;
+				scale *= 0.1;
+				++pos;
+				anyDigit = true;
+			}
+		}
+
+		if (!anyDigit) {
+			throw runtime_error("Expected a primary");
+		}
+
+		if (pos < source.size() && (source[pos] == 'e' || source[pos] == 'E')) {
+			++pos;
+			bool negative = false;
+			if (pos < source.size() && (source[pos] == '+' || source[pos] == '-')) {
+				negative = source[pos] == '-';
+				++pos;
+			}
+			int exponent = 0;
+			while (pos < source.size() && isDigitChar(source[pos])) {
+				exponent = exponent * 10 + (source[pos] - '0');
+				++pos;
+			}
+			for (int i = 0; i < exponent; ++i) {
+				value = negative ? value / 10.0 : value * 10.0;
+			}
+		}
+
+		return value;
+	}
+
+	// handles 'primary ->' production rules
+	constexpr double primary() {
+		skipSpace();
+		if (pos >= source.size()) {
+			throw runtime_error("Expected a primary");
+		}
+
+		char ch = source[pos];
+		if (ch == '+') {
+			++pos;
+			return primary();
+		}
+		if (ch == '-') {
+			++pos;
+			return -primary();
+		}
+		if (ch == '(') {
+			++pos;
+			double expr = expression();
+			if (!consume(')')) {
+				throw runtime_error("Missing a right parenthesis.");
+			}
+			return expr;
+		}
+		if (isDigitChar(ch) || ch == '.') {
+			return number();
+		}
+		if (isAlphaChar(ch)) {
+			return functionCall();
+		}
+
+		throw runtime_error("Expected a primary");
+	}
+
+	// Parses and applies a call of one of the compile-time functions
+	constexpr double functionCall() {
+		size_t start = pos;
+		while (pos < source.size() && (isAlphaChar(source[pos])
+				|| isDigitChar(source[pos]))) {
+			++pos;
+		}
+		string_view name = source.substr(start, pos - start);
+
+		bool binary = name == "min" || name == "max";
+		if (!binary && name != "sqrt" && name != "abs") {
+			throw runtime_error("Unknown function in a constant expression.");
+		}
+
+		if (!consume('(')) {
+			throw runtime_error("Expected '(' after a function name");
+		}
+		double first = expression();
+		double second = 0.0;
+		if (binary) {
+			if (!consume(',')) {
+				throw runtime_error("Expected ',' between function arguments");
+			}
+			second = expression();
+		}
+		if (!consume(')')) {
+			throw runtime_error("Expected ')' after the function argument(s)");
+		}
+
+		if (name == "sqrt") {
+			return constantSqrt(first);
+		}
+		if (name == "abs") {
+			return first < 0.0 ? -first : first;
+		}
+		if (name == "min") {
+			return first < second ? first : second;
+		}
+		return first < second ? second : first;
+	}
+
+	// handles 'term ->' production rules
+	constexpr double term() {
+		double left = primary();
+		while (true) {
+			if (consume('*')) {
+				left *= primary();
+			}
+			else if (consume('/')) {
+				double right = primary();
+				if (right == 0.0) {
+					throw runtime_error("Division by zero");
+				}
+				left /= right;
+			}
+			else if (consume('%')) {
+				double right = primary();
+				if (right == 0.0) {
+					throw runtime_error("Division by zero");
+				}
+				// truncated-division remainder; fmod is not constexpr, and
+				// build-time formulas stay well inside long long range
+				left -= static_cast<double>(static_cast<long long>(left / right)) * right;
+			}
+			else {
+				return left;
+			}
+		}
+	}
+
+	// handles 'expression ->' production rules
+	constexpr double expression() {
+		double left = term();
+		while (true) {
+			if (consume('+')) {
+				left += term();
+			}
+			else if (consume('-')) {
+				left -= term();
+			}
+			else {
+				return left;
+			}
+		}
+	}
+
+public:
+	constexpr ConstexprEvaluator(string_view source) :source(source) {}
+
+	constexpr double run() {
+		double value = expression();
+		skipSpace();
+		if (pos != source.size()) {
+			throw runtime_error("Unexpected token.");
+		}
+		return value;
+	}
+};
+
+// Evaluates a complete formula; in a constexpr context the result folds to
+// a constant and any error in the formula fails the build
+constexpr double evalConstant(string_view source) {
+	return ConstexprEvaluator{ source }.run();
+}
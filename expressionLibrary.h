@@ -0,0 +1,359 @@
+// Contains the precompiled expression library: an offline compile step that
+// serializes bytecode programs for a file of 'let' declarations into one
+// relocatable blob, and a loader that memory-maps the blob at startup.
+// Loading touches only the header, the directories and the name blob - one
+// mmap, a header check and the interning of the formula names; the program
+// payload pages stay untouched until a formula is first referenced, so
+// rarely used formulas are never paged in at all. Programs store variable
+// IDs of the offline interner; they are remapped to the live interner's IDs
+// when a formula is materialized, which keeps the blob position- and
+// session-independent. resolve() evaluates a formula on first use, pulling
+// in the formulas it references first.
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "arena.h"
+#include "bytecode.h"
+#include "compiledExpression.h"
+#include "lineTokenizer.h"
+#include "mappedFile.h"
+#include "variable.h"
+
+using namespace std;
+
+// Fixed-width framing of the blob: the header, one LibraryName per interned
+// name (in offline ID order), one LibraryFormula per declaration, the name
+// blob, then the payload of instruction and constant arrays
+class LibraryHeader {
+public:
+	char magic[4];
+	uint32_t version;
+	uint32_t internedCount;
+	uint32_t formulaCount;
+	uint64_t namesSize;
+	uint64_t payloadSize;
+};
+
+class LibraryName {
+public:
+	uint32_t offset;
+	uint32_t length;
+};
+
+class LibraryFormula {
+public:
+	uint32_t nameId;
+	uint32_t instructionCount;
+	uint32_t constantCount;
+	uint32_t maxStack;
+	uint64_t codeOffset;
+	uint64_t constantsOffset;
+};
+
+const char libraryMagic[4] = { 'C', 'L', 'I', 'B' };
+const uint32_t libraryVersion = 1;
+
+// The memory-mapped library. Formula names are interned into the live
+// interner at load; programs are materialized (copied out of the mapping
+// with their variable IDs remapped) only when first resolved.
+class ExpressionLibrary {
+private:
+	MappedFile file;
+	string path;
+	const LibraryName* nameRecords;
+	const LibraryFormula* formulas;
+	const char* names;
+	const char* payload;
+	uint32_t formulaCount;
+
+	// offline interner ID -> live interner ID
+	vector<int> idMap;
+
+	// live name ID -> directory slot of the formula declaring it
+	map<int, int> formulaOf;
+
+	vector<unique_ptr<BytecodeProgram>> materialized;
+	vector<char> resolving;
+
+	void fail() const {
+		throw runtime_error("File '" + path + "' is not a valid expression library.");
+	}
+
+	// Copies the formula's program out of the mapping, remapping LOAD_VAR
+	// operands to live interner IDs; the first access to a formula is what
+	// pages its part of the payload in
+	const BytecodeProgram& materialize(int slot) {
+		if (materialized[slot] != nullptr) {
+			return *materialized[slot];
+		}
+
+		const LibraryFormula& formula = formulas[slot];
+		auto program = make_unique<BytecodeProgram>();
+		program->code.reserve(formula.instructionCount);
+		const char* cursor = payload + formula.codeOffset;
+
+		// the blob's stack discipline is simulated rather than trusted, so a
+		// corrupt program can neither underflow the value stack in eval() nor
+		// outgrow the depth it declared
+		int depth = 0;
+		int maxDepth = 0;
+		for (uint32_t i = 0; i < formula.instructionCount; ++i) {
+			uint32_t op;
+			int operand;
+			memcpy(&op, cursor, sizeof(op));
+			memcpy(&operand, cursor + sizeof(op), sizeof(operand));
+			cursor += sizeof(op) + sizeof(operand);
+
+			// a corrupt blob must not index past any of the pools
+			int pops = 0;
+			switch (static_cast<OpCode>(op)) {
+			case OpCode::LOAD_VAR:
+				if (operand < 0 || operand >= static_cast<int>(idMap.size())) {
+					fail();
+				}
+				operand = idMap[operand];
+				break;
+			case OpCode::PUSH_CONST:
+				if (operand < 0
+						|| operand >= static_cast<int>(formula.constantCount)) {
+					fail();
+				}
+				break;
+			case OpCode::CALL_FN:
+				if (operand < 0 || operand >= functionCount) {
+					fail();
+				}
+				pops = functionTable[operand].arity;
+				break;
+			case OpCode::NEG:
+				pops = 1;
+				break;
+			case OpCode::ADD:
+			case OpCode::SUB:
+			case OpCode::MUL:
+			case OpCode::DIV:
+			case OpCode::MOD:
+				pops = 2;
+				break;
+			default:
+				fail();
+			}
+
+			// every opcode pops its operands and pushes one result
+			if (depth < pops) {
+				fail();
+			}
+			depth -= pops - 1;
+			if (depth > maxDepth) {
+				maxDepth = depth;
+			}
+			program->code.push_back(Instruction{ static_cast<OpCode>(op), operand });
+		}
+		if (depth != 1) {
+			fail();
+		}
+
+		program->constants.resize(formula.constantCount);
+		memcpy(program->constants.data(), payload + formula.constantsOffset,
+			formula.constantCount * sizeof(double));
+
+		program->maxStack = maxDepth;
+		materialized[slot] = move(program);
+		return *materialized[slot];
+	}
+
+public:
+	// Compiles every line of the input file (each must be a 'let'
+	// declaration) and writes the blob; this is the offline step, run once
+	// per deployment
+	static void compileFile(const string& inputPath, const string& outputPath) {
+		NameInterner interner;
+		Arena arena;
+		ExpressionCompiler compiler{ arena };
+		LineTokenizer tokenizer{ "", interner };
+
+		vector<LibraryFormula> formulas;
+		string payload;
+		MappedFile input{ inputPath };
+		MappedLineReader reader{ input };
+		string_view line;
+
+		while (reader.next(line)) {
+			tokenizer.reset(line);
+			CompiledStatement statement = compiler.compileStatement(tokenizer, interner);
+			if (statement.defineSymbol < 0) {
+				throw runtime_error("Every library line must be a 'let' declaration.");
+			}
+
+			BytecodeProgram program = BytecodeCompiler{}.compile(statement.expr);
+
+			LibraryFormula formula{};
+			formula.nameId = static_cast<uint32_t>(statement.defineSymbol);
+			formula.instructionCount = static_cast<uint32_t>(program.code.size());
+			formula.constantCount = static_cast<uint32_t>(program.constants.size());
+			formula.maxStack = static_cast<uint32_t>(program.maxStackDepth());
+			formula.codeOffset = payload.size();
+
+			// instructions as explicit {op, operand} pairs, free of struct padding
+			for (const Instruction& instr : program.code) {
+				uint32_t op = static_cast<uint32_t>(instr.op);
+				payload.append(reinterpret_cast<const char*>(&op), sizeof(op));
+				payload.append(reinterpret_cast<const char*>(&instr.operand),
+					sizeof(instr.operand));
+			}
+			formula.constantsOffset = payload.size();
+			payload.append(reinterpret_cast<const char*>(program.constants.data()),
+				program.constants.size() * sizeof(double));
+
+			formulas.push_back(formula);
+			arena.reset();
+		}
+
+		// the name blob carries every offline interner entry in ID order, so the
+		// loader can rebuild the ID mapping with one intern per name
+		string names;
+		vector<LibraryName> nameRecords;
+		for (int id = 0; id < interner.count(); ++id) {
+			const string& name = interner.nameOf(id);
+			nameRecords.push_back(LibraryName{ static_cast<uint32_t>(names.size()),
+				static_cast<uint32_t>(name.size()) });
+			names += name;
+		}
+
+		LibraryHeader header{};
+		memcpy(header.magic, libraryMagic, sizeof(libraryMagic));
+		header.version = libraryVersion;
+		header.internedCount = static_cast<uint32_t>(nameRecords.size());
+		header.formulaCount = static_cast<uint32_t>(formulas.size());
+		header.namesSize = names.size();
+		header.payloadSize = payload.size();
+
+		FILE* file = fopen(outputPath.c_str(), "wb");
+		if (file == nullptr) {
+			throw runtime_error("Cannot write library file '" + outputPath + "'");
+		}
+		bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+			&& (nameRecords.empty() || fwrite(nameRecords.data(),
+				sizeof(LibraryName), nameRecords.size(), file) == nameRecords.size())
+			&& (formulas.empty() || fwrite(formulas.data(),
+				sizeof(LibraryFormula), formulas.size(), file) == formulas.size())
+			&& (names.empty() || fwrite(names.data(), names.size(), 1, file) == 1)
+			&& (payload.empty() || fwrite(payload.data(), payload.size(), 1, file) == 1);
+		fclose(file);
+		if (!ok) {
+			throw runtime_error("Cannot write library file '" + outputPath + "'");
+		}
+	}
+
+	// Maps the blob and indexes its formulas; throws when the file is
+	// missing or not a library
+	ExpressionLibrary(const string& path, NameInterner& interner)
+		:file(path), path(path) {
+		LibraryHeader header{};
+		if (file.size() < sizeof(header)) {
+			fail();
+		}
+		memcpy(&header, file.data(), sizeof(header));
+		if (memcmp(header.magic, libraryMagic, sizeof(libraryMagic)) != 0
+				|| header.version != libraryVersion) {
+			fail();
+		}
+
+		if (header.namesSize > file.size() || header.payloadSize > file.size()) {
+			fail();
+		}
+		size_t expected = sizeof(header)
+			+ header.internedCount * sizeof(LibraryName)
+			+ header.formulaCount * sizeof(LibraryFormula)
+			+ header.namesSize + header.payloadSize;
+		if (file.size() < expected) {
+			fail();
+		}
+
+		nameRecords = reinterpret_cast<const LibraryName*>(file.data() + sizeof(header));
+		formulas = reinterpret_cast<const LibraryFormula*>(
+			reinterpret_cast<const char*>(nameRecords)
+			+ header.internedCount * sizeof(LibraryName));
+		names = reinterpret_cast<const char*>(formulas)
+			+ header.formulaCount * sizeof(LibraryFormula);
+		payload = names + header.namesSize;
+		formulaCount = header.formulaCount;
+
+		for (uint32_t id = 0; id < header.internedCount; ++id) {
+			// overflow-safe form: the 32-bit sum of offset and length wraps
+			if (nameRecords[id].length > header.namesSize
+					|| nameRecords[id].offset > header.namesSize - nameRecords[id].length) {
+				fail();
+			}
+			idMap.push_back(interner.intern(string_view(
+				names + nameRecords[id].offset, nameRecords[id].length)));
+		}
+
+		// every directory record must stay inside the payload before any of
+		// it is trusted, mirroring the offset checks of snapshot.h
+		for (uint32_t slot = 0; slot < formulaCount; ++slot) {
+			const LibraryFormula& formula = formulas[slot];
+			uint64_t codeBytes = static_cast<uint64_t>(formula.instructionCount)
+				* (sizeof(uint32_t) + sizeof(int));
+			uint64_t constantBytes = static_cast<uint64_t>(formula.constantCount)
+				* sizeof(double);
+			if (formula.nameId >= header.internedCount
+					|| codeBytes > header.payloadSize
+					|| formula.codeOffset > header.payloadSize - codeBytes
+					|| constantBytes > header.payloadSize
+					|| formula.constantsOffset > header.payloadSize - constantBytes) {
+				fail();
+			}
+			formulaOf[idMap[formula.nameId]] = static_cast<int>(slot);
+		}
+		materialized.resize(formulaCount);
+		resolving.assign(formulaCount, 0);
+	}
+
+	size_t size() const {
+		return formulaCount;
+	}
+
+	// Returns whether the library declares a formula with the given live
+	// name ID
+	bool contains(int id) const {
+		return formulaOf.find(id) != formulaOf.end();
+	}
+
+	// Makes the named formula available in the table: formulas it references
+	// are resolved first, then its program runs once and defines the name.
+	// Already defined names (and unknown ones) are left alone.
+	void resolve(int id, VarTable& varTable) {
+		double defined;
+		if (varTable.tryGet(id, defined)) {
+			return;
+		}
+		auto found = formulaOf.find(id);
+		if (found == formulaOf.end()) {
+			return;
+		}
+
+		int slot = found->second;
+		if (resolving[slot]) {
+			throw runtime_error("Cyclic declaration in the expression library.");
+		}
+		resolving[slot] = 1;
+
+		const BytecodeProgram& program = materialize(slot);
+		for (const Instruction& instr : program.code) {
+			if (instr.op == OpCode::LOAD_VAR) {
+				resolve(instr.operand, varTable);
+			}
+		}
+		varTable.define(id, program.eval(varTable));
+
+		resolving[slot] = 0;
+	}
+};
@@ -0,0 +1,79 @@
+// Contains the small-expression fast path for batch evaluation. Over half
+// of real batch lines are trivial shapes - a single number, a variable, or
+// 'operand op operand' - yet the full recursive descent walks them through
+// statement(), expression(), term() and primary() with get()/putback()
+// traffic at every level, several times the work of the arithmetic itself.
+// The recognizer here evaluates those shapes straight from the first few
+// tokens and reports false for anything else (including division and modulo
+// by zero, so their error reporting stays on the general path).
+#pragma once
+#include <cmath>
+#include <string_view>
+
+#include "lineTokenizer.h"
+#include "variable.h"
+
+using namespace std;
+
+// Reads the value of an operand token into out; false when the token is
+// neither a number nor a defined variable
+inline bool fastPathOperand(const Token& token, const VarTable& varTable,
+		double& out) {
+	if (token.kind == TokenType::NUMBER) {
+		out = token.value;
+		return true;
+	}
+	if (token.kind == TokenType::NAME) {
+		return varTable.tryGet(token.symbol, out);
+	}
+	return false;
+}
+
+// Evaluates the line if it matches 'operand' or 'operand op operand' with op
+// one of + - * / %. The tokenizer must be freshly reset to the line; when
+// this returns false the caller resets it again and runs the general parser.
+inline bool tryFastPath(LineTokenizer& tokenizer, const VarTable& varTable,
+		double& out) {
+	double left;
+	if (!fastPathOperand(tokenizer.tryGet(), varTable, left)) {
+		return false;
+	}
+
+	Token op = tokenizer.tryGet();
+	if (op.kind == TokenType::INPUT_EOF) {
+		out = left;
+		return true;
+	}
+
+	double right;
+	if (!fastPathOperand(tokenizer.tryGet(), varTable, right)
+			|| tokenizer.tryGet().kind != TokenType::INPUT_EOF) {
+		return false;
+	}
+
+	switch (op.kind) {
+	case TokenType::ADD:
+		out = left + right;
+		return true;
+	case TokenType::SUB:
+		out = left - right;
+		return true;
+	case TokenType::MUL:
+		out = left * right;
+		return true;
+	case TokenType::DIV:
+		if (right == 0.0) {
+			return false;
+		}
+		out = left / right;
+		return true;
+	case TokenType::MOD:
+		if (right == 0.0) {
+			return false;
+		}
+		out = fmod(left, right);
+		return true;
+	default:
+		return false;
+	}
+}
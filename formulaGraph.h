@@ -0,0 +1,181 @@
+// Contains retained formulas with dependency tracking for incremental
+// re-evaluation. A dashboard-style client adds each statement once; when a
+// variable is redefined through the graph, only the formulas that
+// (transitively) depend on it are re-evaluated, while every other formula
+// keeps its cached result - an O(affected formulas) refresh instead of
+// re-entering and re-parsing everything.
+#pragma once
+#include <string_view>
+#include <vector>
+
+#include "arena.h"
+#include "compiledExpression.h"
+#include "lineTokenizer.h"
+#include "variable.h"
+
+using namespace std;
+
+class FormulaGraph {
+private:
+	// One retained statement with its last result. dirty marks it for
+	// re-evaluation on the next refresh.
+	class Formula {
+	public:
+		CompiledStatement statement;
+		double cached;
+		bool dirty;
+
+		Formula(CompiledStatement statement)
+			:statement(move(statement)), cached(0.0), dirty(false) {}
+	};
+
+	VarTable& varTable;
+
+	// all retained ASTs live here for the lifetime of the graph
+	Arena arena;
+	vector<Formula> formulas;
+
+	// symbol ID -> indices of the formulas whose expressions read it
+	vector<vector<int>> readers;
+
+	// total number of formula evaluations caused by define(), so clients
+	// (and tests) can verify that refreshes stay proportional to the
+	// affected formulas
+	long long evaluations;
+
+	// Records every variable the subtree reads into the readers lists
+	void recordReads(const ExprNode& node, int formula) {
+		if (node.type == ExprNodeType::VARIABLE) {
+			if (node.symbol >= static_cast<int>(readers.size())) {
+				readers.resize(node.symbol + 1);
+			}
+			readers[node.symbol].push_back(formula);
+			return;
+		}
+		if (node.left != nullptr) {
+			recordReads(*node.left, formula);
+		}
+		if (node.right != nullptr) {
+			recordReads(*node.right, formula);
+		}
+	}
+
+	// Returns whether the subtree (transitively, through the declarations
+	// already in the graph) reads the given symbol; visited guards against
+	// re-expanding a declaration and is indexed by symbol ID
+	bool dependsOn(const ExprNode& node, int symbol, vector<char>& visited) {
+		if (node.type == ExprNodeType::VARIABLE) {
+			if (node.symbol == symbol) {
+				return true;
+			}
+			if (node.symbol >= 0 && node.symbol < static_cast<int>(visited.size())
+					&& !visited[node.symbol]) {
+				visited[node.symbol] = 1;
+				for (const Formula& formula : formulas) {
+					if (formula.statement.defineSymbol == node.symbol
+							&& dependsOn(formula.statement.expr.getRoot(),
+								symbol, visited)) {
+						return true;
+					}
+				}
+			}
+			return false;
+		}
+		if (node.left != nullptr && dependsOn(*node.left, symbol, visited)) {
+			return true;
+		}
+		return node.right != nullptr && dependsOn(*node.right, symbol, visited);
+	}
+
+	// Marks every formula reading the symbol for re-evaluation
+	void markDependents(int symbol) {
+		if (symbol < 0 || symbol >= static_cast<int>(readers.size())) {
+			return;
+		}
+		for (int formula : readers[symbol]) {
+			formulas[formula].dirty = true;
+		}
+	}
+
+	// Re-evaluates dirty formulas in the order they were added. A 'let'
+	// formula whose value changed marks its own readers, so updates cascade
+	// through chains of declarations; a cascade reaching an earlier formula
+	// triggers another pass.
+	void refresh() {
+		bool anyDirty = true;
+		while (anyDirty) {
+			for (Formula& formula : formulas) {
+				if (!formula.dirty) {
+					continue;
+				}
+				formula.dirty = false;
+
+				double result = formula.statement.eval(varTable);
+				++evaluations;
+				if (formula.statement.defineSymbol >= 0 && result != formula.cached) {
+					markDependents(formula.statement.defineSymbol);
+				}
+				formula.cached = result;
+			}
+
+			anyDirty = false;
+			for (const Formula& formula : formulas) {
+				if (formula.dirty) {
+					anyDirty = true;
+					break;
+				}
+			}
+		}
+	}
+
+public:
+	FormulaGraph(VarTable& varTable) :varTable(varTable), evaluations(0) {}
+
+	// Compiles the line, retains it, evaluates it once, and returns its
+	// handle for valueOf()
+	int add(string_view line) {
+		LineTokenizer tokenizer{ line, varTable.getInterner() };
+		int id = static_cast<int>(formulas.size());
+		formulas.emplace_back(
+			ExpressionCompiler{ arena }.compileStatement(tokenizer, varTable.getInterner()));
+
+		Formula& formula = formulas.back();
+
+		// a declaration depending on its own symbol would re-dirty itself on
+		// every refresh pass and cascade forever; reject it up front
+		if (formula.statement.defineSymbol >= 0) {
+			vector<char> visited(varTable.getInterner().count(), 0);
+			if (dependsOn(formula.statement.expr.getRoot(),
+					formula.statement.defineSymbol, visited)) {
+				formulas.pop_back();
+				throw runtime_error("Cyclic dependency in a formula declaration.");
+			}
+		}
+
+		recordReads(formula.statement.expr.getRoot(), id);
+		formula.cached = formula.statement.eval(varTable);
+		return id;
+	}
+
+	// Redefines the variable and refreshes only the formulas that depend
+	// on it
+	double define(const string& name, double value) {
+		varTable.define(name, value);
+		markDependents(varTable.getInterner().find(name));
+		refresh();
+		return value;
+	}
+
+	// Returns the cached result of the formula; never re-evaluates
+	double valueOf(int formula) const {
+		return formulas[formula].cached;
+	}
+
+	long long evaluationCount() const {
+		return evaluations;
+	}
+
+	int size() const {
+		return static_cast<int>(formulas.size());
+	}
+};
@@ -0,0 +1,55 @@
+// Contains the registry of built-in math functions. A tokenizer resolves a
+// name to a function index once, at scan time, through the interner (see
+// NameInterner in variable.h) - there is no per-call string comparison - and
+// every evaluator dispatches a call through this flat table of function
+// pointers instead of a growing switch.
+#pragma once
+#include <cmath>
+#include <stdexcept>
+
+using namespace std;
+
+// indices into functionTable of the functions some backends special-case
+// (e.g. the packed sqrt/min/max in vectorEval.h); must match the table order
+const int FUNC_SQRT = 0;
+const int FUNC_MIN = 7;
+const int FUNC_MAX = 8;
+
+inline double fnSqrt(double x) {
+	if (x < 0.0) {
+		throw runtime_error("Argument of 'sqrt' function must not be negative.");
+	}
+	return sqrt(x);
+}
+
+inline double fnSin(double x) { return sin(x); }
+inline double fnCos(double x) { return cos(x); }
+inline double fnExp(double x) { return exp(x); }
+inline double fnLog(double x) { return log(x); }
+inline double fnAbs(double x) { return fabs(x); }
+inline double fnPow(double left, double right) { return pow(left, right); }
+inline double fnMin(double left, double right) { return left < right ? left : right; }
+inline double fnMax(double left, double right) { return left > right ? left : right; }
+
+// One registered function: unary entries fill 'unary', binary ones 'binary'
+class FunctionInfo {
+public:
+	const char* name;
+	int arity;
+	double (*unary)(double);
+	double (*binary)(double, double);
+};
+
+const FunctionInfo functionTable[] = {
+	{ "sqrt", 1, fnSqrt, nullptr },
+	{ "sin", 1, fnSin, nullptr },
+	{ "cos", 1, fnCos, nullptr },
+	{ "exp", 1, fnExp, nullptr },
+	{ "log", 1, fnLog, nullptr },
+	{ "abs", 1, fnAbs, nullptr },
+	{ "pow", 2, nullptr, fnPow },
+	{ "min", 2, nullptr, fnMin },
+	{ "max", 2, nullptr, fnMax },
+};
+
+const int functionCount = static_cast<int>(sizeof(functionTable) / sizeof(functionTable[0]));
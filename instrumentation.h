@@ -0,0 +1,108 @@
+// Contains opt-in hot-path instrumentation. Enable it by adding CALC_PROFILE
+// to PreprocessorDefinitions in Calculator.vcxproj (or -DCALC_PROFILE on the
+// command line); without it the CALC_PROFILE_SCOPE macro expands to nothing
+// and no instrumentation code is compiled at all. When enabled, each
+// instrumented scope costs two rdtsc reads into plain thread-local counters
+// - cheap enough to stay on in canary deployments. Per-thread totals are
+// folded into global counters when a thread ends and a summary is printed to
+// stderr when the process exits.
+#pragma once
+
+#ifdef CALC_PROFILE
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+
+// instrumented code locations; must stay in step with profileSiteNames
+enum ProfileSite {
+	PROFILE_TOKEN_GET,
+	PROFILE_PRIMARY,
+	PROFILE_TERM,
+	PROFILE_EXPRESSION,
+	PROFILE_VAR_GET,
+	PROFILE_SITE_COUNT
+};
+
+const char* const profileSiteNames[PROFILE_SITE_COUNT] = {
+	"token get",
+	"primary()",
+	"term()",
+	"expression()",
+	"VarTable::get()"
+};
+
+// process-wide totals, updated only when a thread's counters are flushed
+inline atomic<uint64_t> profileTotalCalls[PROFILE_SITE_COUNT];
+inline atomic<uint64_t> profileTotalCycles[PROFILE_SITE_COUNT];
+
+// This thread's counters: plain (non-atomic) memory, so the hot path never
+// contends with other threads. The destructor folds them into the global
+// totals when the thread ends.
+class ProfileCounters {
+public:
+	uint64_t calls[PROFILE_SITE_COUNT] = {};
+	uint64_t cycles[PROFILE_SITE_COUNT] = {};
+
+	~ProfileCounters() {
+		for (int site = 0; site < PROFILE_SITE_COUNT; ++site) {
+			profileTotalCalls[site] += calls[site];
+			profileTotalCycles[site] += cycles[site];
+		}
+	}
+};
+
+inline thread_local ProfileCounters profileCounters;
+
+// Prints the summary at process exit. Statics are destroyed after the main
+// thread's thread-locals, so every counter has been flushed by then.
+class ProfileReporter {
+public:
+	~ProfileReporter() {
+		fprintf(stderr, "\n%-18s %14s %16s %12s\n",
+			"profile site", "calls", "cycles", "cycles/call");
+		for (int site = 0; site < PROFILE_SITE_COUNT; ++site) {
+			uint64_t calls = profileTotalCalls[site];
+			uint64_t cycles = profileTotalCycles[site];
+			fprintf(stderr, "%-18s %14llu %16llu %12.1f\n",
+				profileSiteNames[site],
+				static_cast<unsigned long long>(calls),
+				static_cast<unsigned long long>(cycles),
+				calls == 0 ? 0.0 : static_cast<double>(cycles) / calls);
+		}
+	}
+};
+
+inline ProfileReporter profileReporter;
+
+// Times the enclosing scope into the given site's counters. Nested scopes
+// (e.g. expression() calling term()) record inclusive cycles.
+class ProfileScope {
+private:
+	ProfileSite site;
+	uint64_t start;
+
+public:
+	ProfileScope(ProfileSite site) :site(site), start(__rdtsc()) {}
+
+	~ProfileScope() {
+		profileCounters.cycles[site] += __rdtsc() - start;
+		++profileCounters.calls[site];
+	}
+};
+
+#define CALC_PROFILE_SCOPE(site) ProfileScope calcProfileScope{ site }
+
+#else
+
+// disabled: no code is generated at the instrumented sites
+#define CALC_PROFILE_SCOPE(site)
+
+#endif
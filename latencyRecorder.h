@@ -0,0 +1,122 @@
+// Contains the always-on latency recorder for the interactive prompt. Every
+// line is timed with one rdtsc pair around its evaluation and counted into a
+// fixed array of log2 buckets - a bit scan and an array increment, well
+// under the 20ns-per-line budget, so it needs no build flag unlike the
+// CALC_PROFILE instrumentation. Lines whose cycle count exceeds a threshold
+// additionally have their source text captured into a small ring, so a
+// pathological input (deep recursion, huge literal) that stalls the prompt
+// leaves a trace. The histogram and the captured lines are dumped on exit
+// and on demand.
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+
+class LatencyRecorder {
+private:
+	static const int bucketCount = 64;
+	static const int slowCapacity = 8;
+
+	uint64_t buckets[bucketCount] = {};
+	uint64_t threshold;
+
+	// ring of the most recently captured slow lines
+	string slowLines[slowCapacity];
+	uint64_t slowCycles[slowCapacity] = {};
+	int slowNext = 0;
+	int slowCount = 0;
+
+public:
+	// Returns the index of the log2 bucket the cycle count falls into
+	static int bucketOf(uint64_t cycles) {
+		if (cycles == 0) {
+			return 0;
+		}
+#if defined(_MSC_VER) && defined(_M_X64)
+		unsigned long index;
+		_BitScanReverse64(&index, cycles);
+		return static_cast<int>(index);
+#elif defined(__GNUC__)
+		return 63 - __builtin_clzll(cycles);
+#else
+		int bucket = 0;
+		while (cycles >>= 1) {
+			++bucket;
+		}
+		return bucket;
+#endif
+	}
+
+	// Lines at or above thresholdCycles have their source text captured
+	LatencyRecorder(uint64_t thresholdCycles) :threshold(thresholdCycles) {}
+
+	// Reads the timestamp before the line is evaluated
+	uint64_t start() const {
+		return __rdtsc();
+	}
+
+	// Closes the rdtsc pair opened by start() and records the line
+	void record(uint64_t startCycles, string_view line) {
+		recordCycles(__rdtsc() - startCycles, line);
+	}
+
+	// The measurement-free core of record(), also used by the tests
+	void recordCycles(uint64_t cycles, string_view line) {
+		++buckets[bucketOf(cycles)];
+		if (cycles >= threshold) {
+			slowCycles[slowNext] = cycles;
+			slowLines[slowNext].assign(line.data(), line.size());
+			slowNext = (slowNext + 1) % slowCapacity;
+			if (slowCount < slowCapacity) {
+				++slowCount;
+			}
+		}
+	}
+
+	uint64_t totalCount() const {
+		uint64_t total = 0;
+		for (int i = 0; i < bucketCount; ++i) {
+			total += buckets[i];
+		}
+		return total;
+	}
+
+	int capturedCount() const {
+		return slowCount;
+	}
+
+	// Prints the non-empty buckets and the captured slow lines
+	void dump(FILE* out) const {
+		fprintf(out, "\nper-line latency (rdtsc cycles, %llu lines):\n",
+			static_cast<unsigned long long>(totalCount()));
+		for (int i = 0; i < bucketCount; ++i) {
+			if (buckets[i] == 0) {
+				continue;
+			}
+			fprintf(out, "  [2^%-2d, 2^%-2d) %12llu\n", i, i + 1,
+				static_cast<unsigned long long>(buckets[i]));
+		}
+
+		if (slowCount == 0) {
+			return;
+		}
+		fprintf(out, "slow lines (at least %llu cycles), oldest first:\n",
+			static_cast<unsigned long long>(threshold));
+		int first = slowCount < slowCapacity ? 0 : slowNext;
+		for (int i = 0; i < slowCount; ++i) {
+			int index = (first + i) % slowCapacity;
+			fprintf(out, "  %12llu  %s\n",
+				static_cast<unsigned long long>(slowCycles[index]),
+				slowLines[index].c_str());
+		}
+	}
+};
@@ -0,0 +1,184 @@
+// Contains a token scanner working directly over an in-memory line of input.
+// Unlike TokenStream it performs no stream operations and no heap allocations:
+// it walks a string_view with a cursor and names are interned straight from
+// slices of the source.
+#pragma once
+#include <string_view>
+#include <charconv>
+#include <stdexcept>
+
+#include "instrumentation.h"
+#include "tokenStream.h"
+#include "variable.h"
+
+using namespace std;
+
+class LineTokenizer {
+private:
+	string_view source;
+	size_t pos;
+	bool bufferFull;
+	Token buffer;
+	NameInterner& interner;
+
+	bool isNameChar(char ch) {
+		return isalpha(static_cast<unsigned char>(ch)) || isdigit(static_cast<unsigned char>(ch));
+	}
+
+	// Reads the next floating-point literal, when its starting position has
+	// already been determined
+	Token readNumber() {
+		size_t start = pos;
+		while (pos < source.size() && (isdigit(static_cast<unsigned char>(source[pos])) || source[pos] == '.')) {
+			++pos;
+		}
+
+		// optional exponent part, e.g. 3.5e-2
+		if (pos < source.size() && (source[pos] == 'e' || source[pos] == 'E')) {
+			size_t exponent = pos + 1;
+			if (exponent < source.size() && (source[exponent] == '+' || source[exponent] == '-')) {
+				++exponent;
+			}
+			if (exponent < source.size() && isdigit(static_cast<unsigned char>(source[exponent]))) {
+				pos = exponent + 1;
+				while (pos < source.size() && isdigit(static_cast<unsigned char>(source[pos]))) {
+					++pos;
+				}
+			}
+		}
+
+		// convert in place with from_chars: no copy, no locale machinery
+		double val = 0.0;
+		from_chars_result parsed = from_chars(source.data() + start, source.data() + pos, val);
+		if (parsed.ec != errc{} || parsed.ptr != source.data() + pos) {
+			return Token{ TokenType::UNKNOWN };
+		}
+
+		return Token{ val };
+	}
+
+	// Reads the next keyword or variable name token starting at the cursor
+	Token readVariableOrKeyword() {
+		size_t start = pos;
+		while (pos < source.size() && isNameChar(source[pos])) {
+			++pos;
+		}
+
+		string_view name = source.substr(start, pos - start);
+
+		// the name slice is interned without copying; one intern resolves
+		// keyword, function and variable names alike
+		int symbol = interner.intern(name);
+		if (interner.isLetKeyword(symbol)) {
+			return Token{ TokenType::KW_LET };
+		}
+		int func = interner.functionOf(symbol);
+		if (func >= 0) {
+			return Token{ TokenType::FUNC, func };
+		}
+
+		return Token{ TokenType::NAME, symbol };
+	}
+
+	// Reads the next token starting at the cursor
+	Token doReadNextToken() {
+		while (pos < source.size() && isspace(static_cast<unsigned char>(source[pos]))) {
+			++pos;
+		}
+
+		if (pos >= source.size()) {
+			return Token{ TokenType::INPUT_EOF };
+		}
+
+		char ch = source[pos];
+		switch (ch) {
+		case '+':
+			++pos;
+			return Token{ TokenType::ADD };
+		case '-':
+			++pos;
+			return Token{ TokenType::SUB };
+		case '*':
+			++pos;
+			return Token{ TokenType::MUL };
+		case '/':
+			++pos;
+			return Token{ TokenType::DIV };
+		case '%':
+			++pos;
+			return Token{ TokenType::MOD };
+		case '(':
+			++pos;
+			return Token{ TokenType::LPAREN };
+		case ')':
+			++pos;
+			return Token{ TokenType::RPAREN };
+		case '=':
+			++pos;
+			return Token{ TokenType::EQUALS };
+		case ',':
+			++pos;
+			return Token{ TokenType::COMMA };
+		default:
+			if (isdigit(static_cast<unsigned char>(ch)) || ch == '.') {
+				return readNumber();
+			}
+			else if (isalpha(static_cast<unsigned char>(ch))) {
+				return readVariableOrKeyword();
+			}
+			else {
+				return Token{ TokenType::UNKNOWN };
+			}
+		}
+	}
+
+public:
+	LineTokenizer(string_view source, NameInterner& interner)
+		:source(source), pos(0), bufferFull(false), buffer(Token{ TokenType::INPUT_EOF }),
+		interner(interner) {}
+
+	// Rewinds the tokenizer onto a new line of input, keeping the instance
+	// (and its internal buffers) alive across lines
+	void reset(string_view newSource) {
+		source = newSource;
+		pos = 0;
+		bufferFull = false;
+	}
+
+	// Gets the next token without throwing; malformed input comes back as
+	// an UNKNOWN token for the exception-free evaluation path
+	Token tryGet() {
+		CALC_PROFILE_SCOPE(PROFILE_TOKEN_GET);
+		if (bufferFull) {
+			bufferFull = false;
+			return buffer;
+		}
+
+		return doReadNextToken();
+	}
+
+	// Gets the next token
+	Token get() {
+		Token nextToken = tryGet();
+		if (nextToken.kind == TokenType::UNKNOWN) {
+			throw runtime_error("Unexpected token.");
+		}
+		return nextToken;
+	}
+
+	// Returns the current character offset of the cursor in the line,
+	// for error reporting
+	size_t position() const {
+		return pos;
+	}
+
+	// Returns the given token to the buffer, so that it is read by the
+	// next call to get
+	void putback(Token token) {
+		if (bufferFull) {
+			throw runtime_error("Called putback with the buffer already full.");
+		}
+		bufferFull = true;
+		buffer = token;
+	}
+};
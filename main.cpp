@@ -56,37 +56,82 @@ author: Libor Vytlacil
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <cstdio>
+
+#ifdef _MSC_VER
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
+#include <fstream>
 #include "tokenStream.h"
 #include "variable.h"
+#include "compiledExpression.h"
+#include "concurrentVarTable.h"
+#include "constexprEval.h"
+#include "expressionLibrary.h"
+#include "formulaGraph.h"
+#include "functionRegistry.h"
+#include "instrumentation.h"
+#include "latencyRecorder.h"
+#include "lineTokenizer.h"
+#include "mappedFile.h"
+#include "parallelBatch.h"
+#include "pipeline.h"
+#include "checkedEval.h"
+#include "fastPath.h"
+#include "resultCache.h"
+#include "binaryOutput.h"
+#include "scopedVarTable.h"
+#include "snapshot.h"
+#include "workStealing.h"
+#include "bytecode.h"
+#include "vectorEval.h"
 
 using namespace std;
 
 // prototypes
-double expression(TokenStream& ts, VarTable& varTable);
+template <typename TS>
+double expression(TS& ts, VarTable& varTable);
 
-double squareRoot(TokenStream& ts, VarTable& varTable) {
-	Token token = ts.get();
+// handles a call of functionTable[func], whose FUNC token has already been
+// consumed; dispatches through the registry's function pointers
+template <typename TS>
+double functionCall(TS& ts, int func, VarTable& varTable) {
+	const FunctionInfo& info = functionTable[func];
+	auto token = ts.get();
 
 	if (token.kind != TokenType::LPAREN) {
-		throw runtime_error("Expected '(' after function 'sqrt'");
+		throw runtime_error("Expected '(' after function '" + string(info.name) + "'");
 	}
 
-	double argument = expression(ts, varTable);
-	if (argument < 0.0) {
-		throw runtime_error("Argument of 'sqrt' function must not be negative.");
+	double first = expression(ts, varTable);
+	double second = 0.0;
+	if (info.arity == 2) {
+		token = ts.get();
+		if (token.kind != TokenType::COMMA) {
+			throw runtime_error("Expected ',' between the arguments of '"
+				+ string(info.name) + "' function.");
+		}
+		second = expression(ts, varTable);
 	}
 
 	token = ts.get();
 	if (token.kind != TokenType::RPAREN) {
-		throw runtime_error("Expected ')' after the argument of 'sqrt' function.");
+		throw runtime_error("Expected ')' after the "
+			+ string(info.arity == 2 ? "arguments" : "argument")
+			+ " of '" + string(info.name) + "' function.");
 	}
 
-	return sqrt(argument);
+	return info.arity == 2 ? info.binary(first, second) : info.unary(first);
 }
 
 // handles 'primary ->' production rules
-double primary(TokenStream& ts, VarTable& varTable) {
-	Token token = ts.get();
+template <typename TS>
+double primary(TS& ts, VarTable& varTable) {
+	CALC_PROFILE_SCOPE(PROFILE_PRIMARY);
+	auto token = ts.get();
 	switch (token.kind) {
 	case TokenType::ADD:
 		return primary(ts, varTable);
@@ -103,9 +148,10 @@ double primary(TokenStream& ts, VarTable& varTable) {
 	case TokenType::NUMBER:
 		return token.value;
 	case TokenType::NAME:
-		return varTable.get(token.name);
-	case TokenType::SQRT:
-		return squareRoot(ts, varTable);
+		// interned names resolve with a single array load
+		return varTable.get(token.symbol);
+	case TokenType::FUNC:
+		return functionCall(ts, token.symbol, varTable);
 	default:
 		ts.putback(token);
 		throw runtime_error("Expected a primary");
@@ -115,9 +161,11 @@ double primary(TokenStream& ts, VarTable& varTable) {
 }
 
 // handles 'term ->' production rules
-double term(TokenStream& ts, VarTable& varTable) {
+template <typename TS>
+double term(TS& ts, VarTable& varTable) {
+	CALC_PROFILE_SCOPE(PROFILE_TERM);
 	double left = primary(ts, varTable);
-	Token token = ts.get();
+	auto token = ts.get();
 	while (true) {
 		switch (token.kind) {
 		case TokenType::MUL:
@@ -150,9 +198,11 @@ double term(TokenStream& ts, VarTable& varTable) {
 }
 
 // handles 'expression ->' production rules
-double expression(TokenStream& ts, VarTable& varTable) {
+template <typename TS>
+double expression(TS& ts, VarTable& varTable) {
+	CALC_PROFILE_SCOPE(PROFILE_EXPRESSION);
 	double left = term(ts, varTable);
-	Token token = ts.get();
+	auto token = ts.get();
 
 	while (true) {
 		switch (token.kind) {
@@ -172,29 +222,32 @@ double expression(TokenStream& ts, VarTable& varTable) {
 }
 
 // handles 'declaration ->' production rule
-double declaration(TokenStream& ts, VarTable& varTable) {
-	Token token = ts.get();
+template <typename TS>
+double declaration(TS& ts, VarTable& varTable) {
+	auto token = ts.get();
 	if (token.kind != TokenType::NAME) {
 		ts.putback(token);
 		throw runtime_error("Expected a variable name after 'let' keyword.");
 	}
-	string name = token.name;
+	int symbol = token.symbol;
 
 	token = ts.get();
 	if (token.kind != TokenType::EQUALS) {
 		ts.putback(token);
-		throw runtime_error("Missing '=' in a declaration of '" + name + "'");
+		throw runtime_error("Missing '=' in a declaration of '"
+			+ varTable.getInterner().nameOf(symbol) + "'");
 	}
 
 	double value = expression(ts, varTable);
-	varTable.define(name, value);
+	varTable.define(symbol, value);
 
 	return value;
 }
 
 // handles 'statement ->' production rules
-double statement(TokenStream& ts, VarTable& varTable) {
-	Token token = ts.get();
+template <typename TS>
+double statement(TS& ts, VarTable& varTable) {
+	auto token = ts.get();
 	switch (token.kind) {
 	case TokenType::KW_LET:
 		return declaration(ts, varTable);
@@ -205,10 +258,11 @@ double statement(TokenStream& ts, VarTable& varTable) {
 }
 
 // hanldes 'Calculation ->' production rules 
-double calculation(TokenStream& ts, VarTable& varTable) {
+template <typename TS>
+double calculation(TS& ts, VarTable& varTable) {
 	double result = 0.0;
 	while (true) {
-		Token token = ts.get();
+		auto token = ts.get();
 
 		if (token.kind == TokenType::INPUT_EOF) {
 			break;
@@ -222,10 +276,169 @@ double calculation(TokenStream& ts, VarTable& varTable) {
 	return result;
 }
 
+const string prompt = "> ";
+const string msgResult = "= ";
+
+// Collects batch results as text, formatted the way the interactive mode
+// prints them, into a large buffer written out only when full
+class TextResultSink {
+private:
+	static const size_t outputBufferLimit = 1 << 20;
+	string outputBuffer;
+
+public:
+	void result(size_t line, double value) {
+		// format the way 'cout << result' would, but into the buffer
+		char formatted[32];
+		int length = snprintf(formatted, sizeof(formatted), "%g", value);
+
+		outputBuffer += msgResult;
+		outputBuffer.append(formatted, length);
+		outputBuffer += '\n';
+
+		if (outputBuffer.size() >= outputBufferLimit) {
+			cout << outputBuffer;
+			outputBuffer.clear();
+		}
+	}
+
+	void error(size_t line, const EvalResult& result) {
+		cerr << describeEvalError(result.error)
+			<< " (column " << result.position + 1 << ")" << '\n';
+	}
+
+	void finish() {
+		cout << outputBuffer;
+		cout.flush();
+	}
+};
+
+// Streams raw little-endian doubles (plus the optional line-index sidecar)
+// instead of text, so downstream consumers skip the double-to-text-to-double
+// round trip; errors still go to stderr as text
+class BinaryResultSink {
+private:
+	BinaryResultWriter writer;
+
+public:
+	BinaryResultSink(ostream& output, ostream* index) :writer(output, index) {}
+
+	void result(size_t line, double value) {
+		writer.append(static_cast<uint32_t>(line), value);
+	}
+
+	void error(size_t line, const EvalResult& result) {
+		cerr << describeEvalError(result.error)
+			<< " (column " << result.position + 1 << ")" << '\n';
+	}
+
+	void finish() {
+		writer.finish();
+	}
+};
+
+// Shared loop of the batch modes. Pulls string_view lines from nextLine
+// until it reports the end of the input and hands every result (or per-line
+// error) to the sink. One tokenizer instance is reused across all lines, so
+// throughput is not limited by per-line construction and flushing. With a
+// library, names on each line are resolved first, like at the prompt.
+template <typename LineSource, typename Sink>
+void runBatchLines(LineSource nextLine, VarTable& varTable, Sink& sink,
+		ExpressionLibrary* library = nullptr) {
+	string_view line;
+	string cacheKey;
+	size_t lineIndex = 0;
+	LineTokenizer tokenizer{ "", varTable.getInterner() };
+
+	// real batch inputs re-submit the same formulas constantly, so results
+	// are memoized by token sequence plus referenced variable values
+	ResultCache cache{ 10000 };
+
+	for (; nextLine(line); ++lineIndex) {
+		double value;
+
+		// library formulas must be defined before the cache key captures
+		// the values the line reads
+		if (library != nullptr) {
+			tokenizer.reset(line);
+			try {
+				Token token = tokenizer.tryGet();
+				while (token.kind != TokenType::INPUT_EOF
+						&& token.kind != TokenType::UNKNOWN) {
+					if (token.kind == TokenType::NAME) {
+						library->resolve(token.symbol, varTable);
+					}
+					token = tokenizer.tryGet();
+				}
+			}
+			catch (runtime_error& e) {
+				cerr << e.what() << '\n';
+			}
+		}
+
+		bool cacheable = buildCacheKey(line, varTable, cacheKey);
+
+		if (!cacheable || !cache.lookup(cacheKey, value)) {
+			// trivial shapes, the majority of real batch lines, are
+			// evaluated straight from their tokens without the parser
+			tokenizer.reset(line);
+			if (!tryFastPath(tokenizer, varTable, value)) {
+				tokenizer.reset(line);
+
+				// the exception-free path keeps malformed lines (a few
+				// percent of real batch inputs) from paying throw/unwind
+				// costs
+				EvalResult result = CheckedEvaluator{ tokenizer, varTable }.run();
+				if (!result.hasValue()) {
+					sink.error(lineIndex, result);
+					continue;
+				}
+				value = result.value;
+			}
+
+			if (cacheable) {
+				cache.insert(cacheKey, value);
+			}
+		}
+
+		sink.result(lineIndex, value);
+	}
+
+	sink.finish();
+}
+
+// Processes the whole standard input without an interactive prompt
+template <typename Sink>
+void runBatch(VarTable& varTable, Sink& sink, ExpressionLibrary* library = nullptr) {
+	ios::sync_with_stdio(false);
+	cin.tie(nullptr);
+
+	string storage;
+	runBatchLines([&](string_view& line) {
+		if (!getline(cin, storage)) {
+			return false;
+		}
+		line = storage;
+		return true;
+	}, varTable, sink, library);
+}
+
+// Maps the given expression file into memory and processes it like runBatch,
+// but with every line served zero-copy straight out of the mapping
+template <typename Sink>
+void runBatchFile(const string& path, VarTable& varTable, Sink& sink,
+		ExpressionLibrary* library = nullptr) {
+	MappedFile file{ path };
+	MappedLineReader reader{ file };
+	runBatchLines([&](string_view& line) {
+		return reader.next(line);
+	}, varTable, sink, library);
+}
+
 void testStatement(const string& input, double expected) {
 	istringstream sstream(input);
-	TokenStream tstream(sstream);
 	VarTable varTable;
+	TokenStream tstream(sstream, varTable.getInterner());
 
 	cout << "Input: " << input << " Result: ";
 	bool success = false;
@@ -247,8 +460,923 @@ void testStatement(const string& input, double expected) {
 	cout << " " << (success ? "[PASS]" : "[FAIL]") << endl;
 }
 
-const string prompt = "> ";
-const string msgResult = "= ";
+// Tokenizes the input with LineTokenizer instead of TokenStream, compiles
+// and evaluates it, and checks the result
+void testLineTokenizer(const string& input, double expected) {
+	VarTable varTable;
+	LineTokenizer tokenizer(input, varTable.getInterner());
+	Arena arena;
+
+	cout << "Input: " << input << " Result: ";
+	bool success = false;
+
+	try {
+		CompiledExpression compiled = ExpressionCompiler{ arena }.compile(tokenizer);
+		double actual = compiled.eval(varTable);
+		cout << actual;
+
+		if (expected == actual) {
+			success = true;
+		}
+	}
+	catch (runtime_error &e) {
+		success = false;
+		cout << "Exception thrown: " << e.what();
+	}
+
+	cout << " " << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Evaluates the input over a small column batch (odd row count, so both the
+// SIMD blocks and the scalar remainder run) and checks every row against the
+// scalar VM
+void testBatchEval(const string& input) {
+	const size_t rows = 7;
+	VarTable varTable;
+	int base = varTable.getInterner().intern("base");
+	int rate = varTable.getInterner().intern("rate");
+	LineTokenizer tokenizer(input, varTable.getInterner());
+	Arena arena;
+
+	cout << "Batch input: " << input << " ";
+	bool success = true;
+
+	try {
+		CompiledExpression compiled = ExpressionCompiler{ arena }.compile(tokenizer);
+		BytecodeProgram program = BytecodeCompiler{}.compile(compiled);
+
+		ColumnTable columns(rows);
+		vector<double> baseValues, rateValues;
+		for (size_t i = 0; i < rows; ++i) {
+			baseValues.push_back(100.0 + 3.0 * i);
+			rateValues.push_back(0.01 * i);
+		}
+		columns.setColumn(base, baseValues);
+		columns.setColumn(rate, rateValues);
+
+		vector<double> results(rows);
+		evalBatch(program, columns, results.data());
+
+		for (size_t i = 0; i < rows; ++i) {
+			varTable.define(base, baseValues[i]);
+			varTable.define(rate, rateValues[i]);
+			if (results[i] != program.eval(varTable)) {
+				success = false;
+			}
+		}
+	}
+	catch (runtime_error &e) {
+		success = false;
+		cout << "Exception thrown: " << e.what();
+	}
+
+	cout << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Lowers the input to bytecode and checks that the program computes the same
+// value as the AST walk
+void testBytecode(const string& input, double expected) {
+	VarTable varTable;
+	varTable.define("x", 4.0);
+	LineTokenizer tokenizer(input, varTable.getInterner());
+	Arena arena;
+
+	cout << "Input: " << input << " Result: ";
+	bool success = false;
+
+	try {
+		CompiledExpression compiled = ExpressionCompiler{ arena }.compile(tokenizer);
+		BytecodeProgram program = BytecodeCompiler{}.compile(compiled);
+		double actual = program.eval(varTable);
+		cout << actual;
+
+		if (expected == actual && compiled.eval(varTable) == actual) {
+			success = true;
+		}
+	}
+	catch (runtime_error &e) {
+		success = false;
+		cout << "Exception thrown: " << e.what();
+	}
+
+	cout << " " << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Exercises the result cache: the same line with the same variable values
+// must hit, and a changed variable value or different spacing-insensitive
+// token sequence must miss
+void testResultCache() {
+	VarTable varTable;
+	varTable.define("x", 2.0);
+	ResultCache cache{ 4 };
+	string key;
+	double value;
+	bool success = true;
+
+	cout << "Result cache: ";
+
+	// miss, insert, then hit with a normalized (differently spaced) line
+	success = success && buildCacheKey("x + 1", varTable, key);
+	success = success && !cache.lookup(key, value);
+	cache.insert(key, 3.0);
+	success = success && buildCacheKey("x+1", varTable, key);
+	success = success && cache.lookup(key, value) && value == 3.0;
+
+	// changing the referenced variable must change the key
+	varTable.define("x", 5.0);
+	success = success && buildCacheKey("x + 1", varTable, key);
+	success = success && !cache.lookup(key, value);
+
+	// declarations and unknown variables are not cacheable
+	success = success && !buildCacheKey("let y = 1", varTable, key);
+	success = success && !buildCacheKey("nosuchvar", varTable, key);
+
+	cout << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Exercises the arena allocator: after reset() the first allocation must
+// reuse the memory of the previous session instead of asking the allocator
+// for more, and compiling into a reset arena must still give correct results
+void testArena() {
+	Arena arena;
+	NameInterner interner;
+	bool success = true;
+
+	cout << "Arena: ";
+
+	ExprNode* first = arena.create<ExprNode>(1.0);
+	arena.create<ExprNode>(2.0);
+	arena.reset();
+	success = success && arena.create<ExprNode>(3.0) == first;
+
+	arena.reset();
+	LineTokenizer tokenizer("(1+2)*4", interner);
+	success = success && ExpressionCompiler{ arena }.compile(tokenizer).eval(VarTable{}) == 12.0;
+
+	cout << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Evaluates several lines through one reused tokenizer instance, mirroring
+// the interactive loop that resets a single LineTokenizer across the whole
+// session; an error on one line must not poison the next
+void testTokenizerReuse(const string& first, const string& second, double expected) {
+	VarTable varTable;
+	LineTokenizer tokenizer{ "", varTable.getInterner() };
+
+	cout << "Input: " << first << " ; " << second << " Result: ";
+	bool success = false;
+
+	try {
+		tokenizer.reset(first);
+		calculation(tokenizer, varTable);
+	}
+	catch (runtime_error&) {
+		// deliberately ignored; the reused instance must recover on reset
+	}
+
+	try {
+		tokenizer.reset(second);
+		double actual = calculation(tokenizer, varTable);
+		cout << actual;
+
+		if (expected == actual) {
+			success = true;
+		}
+	}
+	catch (runtime_error& e) {
+		success = false;
+		cout << "Exception thrown: " << e.what();
+	}
+
+	cout << " " << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// The static_asserts are the real test of the constexpr engine - they fail
+// the build if a formula stops folding or folds to the wrong constant. The
+// runtime check only confirms that the folded value agrees with what the
+// interpreted grammar computes for the same formula.
+void testConstexprEval() {
+	static_assert(evalConstant("2") == 2.0, "literal");
+	static_assert(evalConstant("1+2*3") == 7.0, "precedence");
+	static_assert(evalConstant("(1+2)*3") == 9.0, "parentheses");
+	static_assert(evalConstant("-4/2") == -2.0, "unary minus and division");
+	static_assert(evalConstant("7%4") == 3.0, "modulo");
+	static_assert(evalConstant("1.5e2") == 150.0, "exponent literal");
+	static_assert(evalConstant("min(2,3)+max(2,3)") == 5.0, "binary functions");
+	static_assert(evalConstant("abs(0-2.5)") == 2.5, "abs");
+	static_assert(evalConstant("3*sqrt(2)+1") > 5.242
+		&& evalConstant("3*sqrt(2)+1") < 5.243, "sqrt");
+
+	cout << "Constexpr eval: ";
+	bool success = false;
+
+	try {
+		constexpr double folded = evalConstant("3*sqrt(2)+1");
+
+		VarTable varTable;
+		LineTokenizer tokenizer{ "3*sqrt(2)+1", varTable.getInterner() };
+		double interpreted = calculation(tokenizer, varTable);
+
+		success = fabs(folded - interpreted) < 1e-12;
+	}
+	catch (runtime_error& e) {
+		success = false;
+		cout << "Exception thrown: " << e.what() << " ";
+	}
+
+	cout << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Runs what-if scenarios against a shared base table through scope layers:
+// shadowed bindings must win while the scope is open, popping must restore
+// the base view in one step, and a reused layer must not resurrect bindings
+// from an earlier scenario
+void testScopedVarTable() {
+	VarTable varTable;
+	ScopedVarTable scoped{ varTable };
+	Arena arena;
+
+	cout << "Scoped variables: ";
+	bool success = false;
+
+	try {
+		varTable.define("x", 2.0);
+		LineTokenizer tokenizer{ "x*10", scoped.getInterner() };
+		CompiledExpression compiled = ExpressionCompiler{ arena }.compile(tokenizer);
+
+		success = compiled.eval(scoped) == 20.0;
+
+		// scenario one: shadow x, add a scenario-only name
+		scoped.push();
+		scoped.define("x", 5.0);
+		scoped.define("extra", 1.0);
+		success = success && compiled.eval(scoped) == 50.0;
+
+		// a nested layer shadows the outer one
+		scoped.push();
+		scoped.define("x", 7.0);
+		success = success && compiled.eval(scoped) == 70.0 && scoped.depth() == 2;
+
+		scoped.pop();
+		success = success && compiled.eval(scoped) == 50.0;
+		scoped.pop();
+
+		// back to the base view; the scenario names left no trace
+		double out;
+		success = success && compiled.eval(scoped) == 20.0
+			&& varTable.get("x") == 2.0
+			&& !scoped.tryGet(scoped.getInterner().intern("extra"), out);
+
+		// scenario two reuses the pooled layer: its old bindings must be gone
+		scoped.push();
+		success = success && compiled.eval(scoped) == 20.0
+			&& !scoped.tryGet(scoped.getInterner().intern("extra"), out);
+		scoped.pop();
+	}
+	catch (runtime_error& e) {
+		success = false;
+		cout << "Exception thrown: " << e.what() << " ";
+	}
+
+	cout << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Checks that the fast-path recognizer accepts exactly the trivial shapes
+// (evaluating them correctly) and rejects everything that needs the parser
+void testFastPath() {
+	VarTable varTable;
+	varTable.define("x", 4.0);
+	LineTokenizer tokenizer{ "", varTable.getInterner() };
+
+	cout << "Fast path: ";
+
+	auto hit = [&](string_view line, double expected) {
+		double value = 0.0;
+		tokenizer.reset(line);
+		return tryFastPath(tokenizer, varTable, value) && value == expected;
+	};
+	auto miss = [&](string_view line) {
+		double value = 0.0;
+		tokenizer.reset(line);
+		return !tryFastPath(tokenizer, varTable, value);
+	};
+
+	bool success = hit("42", 42.0)
+		&& hit("x", 4.0)
+		&& hit(" x * 2 ", 8.0)
+		&& hit("10-x", 6.0)
+		&& hit("9%x", 1.0)
+		&& miss("1+2*3")       // three operators need precedence handling
+		&& miss("1/0")         // errors must report through the general path
+		&& miss("sqrt(4)")
+		&& miss("y+1")         // undefined variable
+		&& miss("let x = 1");
+
+	cout << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Runs a few lines through the binary result sink and checks the framing
+// header, the raw double payload, and the line-index sidecar; the failing
+// line must produce no record and its index must be absent
+void testBinaryOutput() {
+	ostringstream output(ios::binary);
+	ostringstream index(ios::binary);
+	VarTable varTable;
+
+	cout << "Binary output: ";
+
+	// the per-line error text is part of the sink contract, not of this
+	// check; keep it out of the test log
+	ostringstream discard;
+	streambuf* oldCerr = cerr.rdbuf(discard.rdbuf());
+
+	vector<string> lines = { "1+1", "1/0", "2*3" };
+	size_t next = 0;
+	BinaryResultSink sink{ output, &index };
+	runBatchLines([&](string_view& line) {
+		if (next >= lines.size()) {
+			return false;
+		}
+		line = lines[next++];
+		return true;
+	}, varTable, sink);
+
+	cerr.rdbuf(oldCerr);
+
+	string results = output.str();
+	string indices = index.str();
+	bool success = results.size() == 8 + 2 * sizeof(double)
+		&& results.compare(0, 4, "CRES") == 0
+		&& indices.size() == 8 + 2 * sizeof(uint32_t)
+		&& indices.compare(0, 4, "CIDX") == 0;
+
+	if (success) {
+		double values[2];
+		uint32_t lineIndices[2];
+		memcpy(values, results.data() + 8, sizeof(values));
+		memcpy(lineIndices, indices.data() + 8, sizeof(lineIndices));
+		success = values[0] == 2.0 && values[1] == 6.0
+			&& lineIndices[0] == 0 && lineIndices[1] == 2;
+	}
+
+	cout << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Writes a few expression files of very different sizes, runs them through
+// the work-stealing pool on several workers, and checks the assembled output
+// block by block: results per file stay in line order and each file is its
+// own session (a 'let' in one file is invisible to the next)
+void testMultiFileBatch() {
+	vector<string> paths = { "multiFileTestA.tmp", "multiFileTestB.tmp",
+		"multiFileTestC.tmp" };
+	{
+		ofstream a(paths[0]);
+		a << "let a = 2\na+1\na*3\n";
+		ofstream b(paths[1]);
+		b << "a+1\n2+2\n";
+		ofstream c(paths[2]);
+		for (int i = 0; i < 200; ++i) {
+			c << "5*5\n";
+		}
+	}
+
+	cout << "Multi-file batch: ";
+
+	ostringstream output;
+	runMultiFileBatch(paths, output, 3);
+
+	ostringstream expected;
+	expected << "=== multiFileTestA.tmp ===\n= 2\n= 3\n= 6\n";
+	expected << "=== multiFileTestB.tmp ===\nUndefined variable (column 2)\n= 4\n";
+	expected << "=== multiFileTestC.tmp ===\n";
+	for (int i = 0; i < 200; ++i) {
+		expected << "= 25\n";
+	}
+
+	bool success = output.str() == expected.str();
+	for (const string& path : paths) {
+		remove(path.c_str());
+	}
+	cout << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Compiles a formula file into a library blob, maps it back in and checks
+// that resolving one formula pulls in exactly its dependencies, that
+// unreferenced formulas stay unevaluated, and that resolve never overwrites
+// an existing binding
+void testExpressionLibrary() {
+	string sourcePath = "libraryTest.tmp";
+	string blobPath = "libraryTestBlob.tmp";
+	{
+		ofstream file(sourcePath);
+		file << "let five = 2+3\nlet fifty = five*10\n";
+		file << "let eight = sqrt(fifty+14)\nlet unused = five+1\n";
+	}
+
+	cout << "Expression library: ";
+	bool success = false;
+
+	try {
+		ExpressionLibrary::compileFile(sourcePath, blobPath);
+
+		VarTable varTable;
+		ExpressionLibrary library{ blobPath, varTable.getInterner() };
+		int eight = varTable.getInterner().intern("eight");
+		int unused = varTable.getInterner().intern("unused");
+
+		library.resolve(eight, varTable);
+
+		double ignored;
+		success = library.size() == 4
+			&& varTable.get("eight") == 8.0
+			&& varTable.get("five") == 5.0
+			&& varTable.get("fifty") == 50.0
+			&& library.contains(unused)
+			&& !varTable.tryGet(unused, ignored);
+
+		varTable.define("five", 1.0);
+		library.resolve(varTable.getInterner().intern("five"), varTable);
+		success = success && varTable.get("five") == 1.0;
+
+		// the batch loop must resolve library formulas exactly like the
+		// prompt does
+		{
+			VarTable batchTable;
+			ExpressionLibrary batchLibrary{ blobPath, batchTable.getInterner() };
+			vector<string> input{ "eight+2" };
+			size_t next = 0;
+			struct {
+				double value = 0.0;
+				void result(size_t line, double v) { value = v; }
+				void error(size_t line, const EvalResult& result) {}
+				void finish() {}
+			} sink;
+			runBatchLines([&](string_view& line) {
+				if (next == input.size()) {
+					return false;
+				}
+				line = input[next++];
+				return true;
+			}, batchTable, sink, &batchLibrary);
+			success = success && sink.value == 10.0;
+		}
+
+		// a truncated blob must be rejected at load, not read out of bounds
+		{
+			ifstream whole(blobPath, ios::binary);
+			stringstream bytes;
+			bytes << whole.rdbuf();
+			string truncated = bytes.str().substr(0, bytes.str().size() / 2);
+			ofstream broken(blobPath, ios::binary | ios::trunc);
+			broken.write(truncated.data(), truncated.size());
+		}
+		bool rejected = false;
+		try {
+			VarTable otherTable;
+			ExpressionLibrary broken{ blobPath, otherTable.getInterner() };
+		}
+		catch (runtime_error&) {
+			rejected = true;
+		}
+		success = success && rejected;
+
+		// a program whose instructions underflow the value stack must be
+		// rejected when materialized, not run
+		{
+			LibraryHeader header{};
+			memcpy(header.magic, libraryMagic, sizeof(libraryMagic));
+			header.version = libraryVersion;
+			header.internedCount = 1;
+			header.formulaCount = 1;
+			header.namesSize = 3;
+			header.payloadSize = sizeof(uint32_t) + sizeof(int);
+			LibraryName name{ 0, 3 };
+			LibraryFormula formula{};
+			formula.instructionCount = 1;
+			formula.maxStack = 1;
+			uint32_t op = static_cast<uint32_t>(OpCode::ADD);
+			int operand = 0;
+			ofstream out(blobPath, ios::binary | ios::trunc);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			out.write(reinterpret_cast<const char*>(&name), sizeof(name));
+			out.write(reinterpret_cast<const char*>(&formula), sizeof(formula));
+			out.write("bad", 3);
+			out.write(reinterpret_cast<const char*>(&op), sizeof(op));
+			out.write(reinterpret_cast<const char*>(&operand), sizeof(operand));
+		}
+		bool rejectedUnderflow = false;
+		try {
+			VarTable badTable;
+			ExpressionLibrary bad{ blobPath, badTable.getInterner() };
+			bad.resolve(badTable.getInterner().intern("bad"), badTable);
+		}
+		catch (runtime_error&) {
+			rejectedUnderflow = true;
+		}
+		success = success && rejectedUnderflow;
+	}
+	catch (runtime_error& e) {
+		success = false;
+		cout << "Exception thrown: " << e.what() << " ";
+	}
+
+	remove(sourcePath.c_str());
+	remove(blobPath.c_str());
+	cout << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Feeds synthetic cycle counts into the recorder and checks the bucket
+// mapping, the total, and that only lines over the threshold are captured
+void testLatencyRecorder() {
+	LatencyRecorder recorder{ 1000 };
+
+	cout << "Latency recorder: ";
+
+	recorder.recordCycles(1, "fast");
+	recorder.recordCycles(999, "fast");
+	recorder.recordCycles(1000, "exactly at the threshold");
+	recorder.recordCycles(5000, "slow");
+
+	bool success = LatencyRecorder::bucketOf(0) == 0
+		&& LatencyRecorder::bucketOf(1) == 0
+		&& LatencyRecorder::bucketOf(1023) == 9
+		&& LatencyRecorder::bucketOf(1024) == 10
+		&& recorder.totalCount() == 4
+		&& recorder.capturedCount() == 2;
+
+	cout << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Drives a file with declarations, expressions, malformed lines and lots of
+// repetition through the three-stage pipeline and checks the output lines
+void testPipeline() {
+	string path = "pipelineTest.tmp";
+	{
+		ofstream file(path);
+		file << "let a = 2\na+1\n1+2*3\nb+1\n1+\nsqrt(a*8)\n";
+		file << "let c = 3 (c + 2) * a\n";
+		for (int i = 0; i < 3000; ++i) {
+			file << "a*5\n";
+		}
+	}
+
+	cout << "Pipelined batch: ";
+
+	ostringstream output;
+	runPipelineBatch(path, output);
+
+	ostringstream expected;
+	expected << "= 2\n= 3\n= 7\nUndefined variable\nExpected a primary\n= 4\n";
+	expected << "= 10\n";
+	for (int i = 0; i < 3000; ++i) {
+		expected << "= 10\n";
+	}
+
+	bool success = output.str() == expected.str();
+	remove(path.c_str());
+	cout << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Hammers one shared binding set from several reader threads while the main
+// thread keeps publishing new versions; every evaluation must see a fully
+// consistent version (one of the two values ever defined, never anything
+// else), and the final version must hold the last write
+void testConcurrentVarTable() {
+	ConcurrentVarTable shared;
+	int k = shared.getInterner().intern("k");
+	shared.define(k, 1.0);
+
+	Arena arena;
+	LineTokenizer tokenizer{ "k * 10", shared.getInterner() };
+	CompiledExpression expr = ExpressionCompiler{ arena }.compile(tokenizer);
+
+	cout << "Concurrent table: ";
+	atomic<bool> failed{ false };
+
+	vector<thread> readers;
+	for (int i = 0; i < 4; ++i) {
+		readers.emplace_back([&] {
+			for (int j = 0; j < 20000 && !failed; ++j) {
+				double value = expr.eval(*shared.snapshot());
+				if (value != 10.0 && value != 20.0) {
+					failed = true;
+				}
+			}
+		});
+	}
+
+	for (int i = 0; i < 1000; ++i) {
+		shared.define(k, i % 2 == 0 ? 2.0 : 1.0);
+	}
+	for (thread& reader : readers) {
+		reader.join();
+	}
+
+	bool success = !failed && shared.snapshot()->get(k) == 1.0;
+	cout << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Saves the variable table to a snapshot file, restores it into a fresh
+// table, and checks that the defined values come back while undefined
+// interned names stay undefined
+void testSnapshot() {
+	const char* path = "snapshotTest.tmp";
+	bool success = true;
+
+	cout << "Snapshot: ";
+
+	try {
+		VarTable saved;
+		saved.define("x", 2.5);
+		saved.define("longvariablename", -1.0e10);
+		saved.getInterner().intern("neverdefined");
+		saveSnapshot(path, saved);
+
+		VarTable restored;
+		double unused;
+		success = success && loadSnapshot(path, restored);
+		success = success && restored.get("x") == 2.5;
+		success = success && restored.get("longvariablename") == -1.0e10;
+		success = success && !restored.tryGet(
+			restored.getInterner().intern("neverdefined"), unused);
+
+		// a missing file is a cold start, not an error
+		success = success && !loadSnapshot("snapshotTestMissing.tmp", restored);
+
+		// a record whose 32-bit offset+length sum wraps must be rejected,
+		// not read out of bounds
+		{
+			SnapshotHeader header{};
+			memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+			header.version = snapshotVersion;
+			header.count = 1;
+			header.namesSize = 4;
+			SnapshotRecord record{ 0xFFFFFFFFu, 2, 1.0 };
+			ofstream out(path, ios::binary | ios::trunc);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+			out.write("name", 4);
+		}
+		bool rejected = false;
+		try {
+			VarTable corrupt;
+			loadSnapshot(path, corrupt);
+		}
+		catch (runtime_error&) {
+			rejected = true;
+		}
+		success = success && rejected;
+
+		// a corrupt count must fail cleanly instead of attempting a huge
+		// allocation
+		{
+			SnapshotHeader header{};
+			memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+			header.version = snapshotVersion;
+			header.count = 0xFFFFFFFFu;
+			ofstream out(path, ios::binary | ios::trunc);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		}
+		rejected = false;
+		try {
+			VarTable corrupt;
+			loadSnapshot(path, corrupt);
+		}
+		catch (runtime_error&) {
+			rejected = true;
+		}
+		success = success && rejected;
+	}
+	catch (runtime_error&) {
+		success = false;
+	}
+
+	remove(path);
+	cout << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Builds a small graph of dependent formulas and checks that redefining one
+// variable re-evaluates exactly the formulas that depend on it - directly or
+// through a 'let' in between - while the rest keep their cached results
+void testFormulaGraph() {
+	VarTable varTable;
+	FormulaGraph graph{ varTable };
+	bool success = true;
+
+	cout << "Formula graph: ";
+
+	try {
+		varTable.define("rate", 0.25);
+		varTable.define("base", 100.0);
+		int total = graph.add("base * (1 + rate)");
+		int fee = graph.add("let fee = base / 50");
+		int doubled = graph.add("fee * 2");
+		int constant = graph.add("2 + 3");
+		success = success && graph.valueOf(total) == 125.0;
+		success = success && graph.valueOf(doubled) == 4.0;
+
+		// only 'total' reads 'rate'; exactly one re-evaluation
+		long long before = graph.evaluationCount();
+		graph.define("rate", 0.5);
+		success = success && graph.valueOf(total) == 150.0;
+		success = success && graph.evaluationCount() == before + 1;
+
+		// 'base' cascades through the 'fee' declaration into 'doubled', but
+		// never touches the constant formula
+		graph.define("base", 200.0);
+		success = success && graph.valueOf(total) == 300.0;
+		success = success && graph.valueOf(fee) == 4.0;
+		success = success && graph.valueOf(doubled) == 8.0;
+		success = success && graph.evaluationCount() == before + 4;
+		success = success && graph.valueOf(constant) == 5.0;
+
+		// self- and mutually-referential declarations would cascade forever
+		// on refresh; both must be rejected when added
+		bool rejected = false;
+		try {
+			graph.add("let loop = loop + 1");
+		}
+		catch (runtime_error&) {
+			rejected = true;
+		}
+		success = success && rejected;
+
+		rejected = false;
+		graph.add("let feeTwice = fee * 2");
+		try {
+			graph.add("let fee = feeTwice + 1");
+		}
+		catch (runtime_error&) {
+			rejected = true;
+		}
+		success = success && rejected;
+
+		// the rejected formulas left no trace; refreshes still work
+		graph.define("base", 100.0);
+		success = success && graph.valueOf(fee) == 2.0;
+	}
+	catch (runtime_error&) {
+		success = false;
+	}
+
+	cout << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Writes a small file, maps it, and checks that line iteration hands back
+// the exact lines across '\n' and '\r\n' endings, including a final line
+// with no terminator
+void testMappedFile() {
+	const char* path = "mappedFileTest.tmp";
+	{
+		ofstream out(path, ios::binary);
+		out << "1+1\r\nlet x = 2\nx*3";
+	}
+
+	cout << "Mapped file: ";
+	bool success = true;
+
+	try {
+		MappedFile file{ path };
+		MappedLineReader reader{ file };
+		string_view line;
+		success = success && reader.next(line) && line == "1+1";
+		success = success && reader.next(line) && line == "let x = 2";
+		success = success && reader.next(line) && line == "x*3";
+		success = success && !reader.next(line);
+	}
+	catch (runtime_error&) {
+		success = false;
+	}
+
+	remove(path);
+	cout << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Evaluates the input through the exception-free path and checks either the
+// value or the reported error code
+void testCheckedEval(const string& input, double expectedValue, EvalError expectedError) {
+	VarTable varTable;
+	varTable.define("x", 4.0);
+	LineTokenizer tokenizer(input, varTable.getInterner());
+
+	cout << "Input: " << input << " Result: ";
+	EvalResult result = CheckedEvaluator{ tokenizer, varTable }.run();
+
+	bool success;
+	if (result.hasValue()) {
+		cout << result.value;
+		success = expectedError == EvalError::NONE && expectedValue == result.value;
+	}
+	else {
+		cout << describeEvalError(result.error) << " (column " << result.position + 1 << ")";
+		success = expectedError == result.error;
+	}
+
+	cout << " " << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Runs several lines of input through the parallel batch driver and checks
+// the whole output text
+void testParallelBatch(const string& input, const string& expected) {
+	VarTable varTable;
+	istringstream in(input);
+	ostringstream out;
+
+	cout << "Parallel batch: ";
+	runParallelBatch(in, out, varTable, 4);
+
+	bool success = out.str() == expected;
+	cout << (success ? "[PASS]" : "[FAIL]") << endl;
+	if (!success) {
+		cout << "Expected:" << endl << expected << "Actual:" << endl << out.str();
+	}
+}
+
+// Compiles the input and checks both its value and how many AST nodes are
+// left after constant folding
+void testConstantFolding(const string& input, int expectedNodes, double expected) {
+	VarTable varTable;
+	varTable.define("x", 1.0);
+	LineTokenizer tokenizer(input, varTable.getInterner());
+	Arena arena;
+
+	cout << "Input: " << input << " Result: ";
+	bool success = false;
+
+	try {
+		CompiledExpression compiled = ExpressionCompiler{ arena }.compile(tokenizer);
+		double actual = compiled.eval(varTable);
+		cout << actual << " (" << compiled.nodeCount() << " nodes)";
+
+		if (expected == actual && expectedNodes == compiled.nodeCount()) {
+			success = true;
+		}
+	}
+	catch (runtime_error &e) {
+		success = false;
+		cout << "Exception thrown: " << e.what();
+	}
+
+	cout << " " << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Evaluates the input the way batch mode does: through a LineTokenizer that
+// interns variable names into the table's interner
+void testBatchStatement(const string& input, double expected) {
+	VarTable varTable;
+	LineTokenizer tokenizer(input, varTable.getInterner());
+
+	cout << "Input: " << input << " Result: ";
+	bool success = false;
+
+	try {
+		double actual = calculation(tokenizer, varTable);
+		cout << actual;
+
+		if (expected == actual) {
+			success = true;
+		}
+	}
+	catch (runtime_error &e) {
+		success = false;
+		cout << "Exception thrown: " << e.what();
+	}
+
+	cout << " " << (success ? "[PASS]" : "[FAIL]") << endl;
+}
+
+// Compiles the input once and evaluates it twice with different bindings of
+// the variable 'x', checking both results
+void testCompiledExpression(const string& input, double x1, double expected1,
+		double x2, double expected2) {
+	istringstream sstream(input);
+	VarTable varTable;
+	TokenStream tstream(sstream, varTable.getInterner());
+	Arena arena;
+
+	cout << "Input: " << input << " Results: ";
+	bool success = false;
+
+	try {
+		CompiledExpression compiled = ExpressionCompiler{ arena }.compile(tstream);
+
+		varTable.define("x", x1);
+		double actual1 = compiled.eval(varTable);
+		varTable.define("x", x2);
+		double actual2 = compiled.eval(varTable);
+		cout << actual1 << ", " << actual2;
+
+		if (expected1 == actual1 && expected2 == actual2) {
+			success = true;
+		}
+	}
+	catch (runtime_error &e) {
+		success = false;
+		cout << "Exception thrown: " << e.what();
+	}
+
+	cout << " " << (success ? "[PASS]" : "[FAIL]") << endl;
+}
 
 void test() {
 	cout << "Tests: " << endl;
@@ -272,25 +1400,259 @@ void test() {
 	testStatement("let x = 3", 3.0);
 	testStatement("let x = 2 (x + 2) * 3", 12.0);
 	testStatement("sqrt(25)", 5.0);
+	testStatement("pow(2,3)", 8.0);
+	testStatement("min(2,3)+max(2,3)", 5.0);
+	testStatement("abs(0-2) + sin(0) + cos(0)", 3.0);
+	testStatement("exp(0) + log(1)", 1.0);
+	testCompiledExpression("x + 1", 1.0, 2.0, 5.0, 6.0);
+	testCompiledExpression("(x + 2) * 3", 2.0, 12.0, -2.0, 0.0);
+	testCompiledExpression("sqrt(x)", 25.0, 5.0, 9.0, 3.0);
+	testLineTokenizer("2 + 6 * 3", 20.0);
+	testLineTokenizer("sqrt(2.5e1)", 5.0);
+	testLineTokenizer("-1--1", 0.0);
+	testTokenizerReuse("let a = 4", "a * a", 16.0);
+	testTokenizerReuse("(1+2", "1+2", 3.0);
+	testBatchStatement("let x = 3", 3.0);
+	testBatchStatement("let x = 2 (x + 2) * 3", 12.0);
+	testBatchStatement("let longname = 2 longname * longname", 4.0);
+	testConstantFolding("(3.2*10+4)/2", 1, 18.0);
+	testConstantFolding("sqrt(2*8)", 1, 4.0);
+	testConstantFolding("(3*5+1)/2 + x", 3, 9.0);
+	testConstantFolding("-(2*3)", 1, -6.0);
+	testConstantFolding("pow(2,10)", 1, 1024.0);
+	testParallelBatch("let a = 2\na+1\na*3\na-2\nlet a = 10\na+1\n",
+		"= 2\n= 3\n= 6\n= 0\n= 10\n= 11\n");
+	testParallelBatch("1+1\n1/0\n2+2\n", "= 2\nDivision by zero\n= 4\n");
+	testParallelBatch("let x = 2 (x + 2) * 3\nx*2\n1+1 )))\n",
+		"= 12\n= 4\nExpected a primary\n");
+	testCheckedEval("let y = x * 2 y + 1", 9.0, EvalError::NONE);
+	testCheckedEval("1/0", 0.0, EvalError::DIVISION_BY_ZERO);
+	testCheckedEval("(1+2", 0.0, EvalError::MISSING_RPAREN);
+	testCheckedEval("2+#", 0.0, EvalError::UNEXPECTED_TOKEN);
+	testCheckedEval("nosuchvar+1", 0.0, EvalError::UNDEFINED_VARIABLE);
+	testCheckedEval("pow(2 3)", 0.0, EvalError::MISSING_COMMA_IN_CALL);
+	testCheckedEval("max(1, 2*3)", 6.0, EvalError::NONE);
+	testResultCache();
+	testBytecode("x*2 + 1", 9.0);
+	testBytecode("sqrt(x) + x%3", 3.0);
+	testBytecode("-(x+1)/2", -2.5);
+	testBytecode("pow(x,2) + min(x,1)", 17.0);
+	testArena();
+	testFormulaGraph();
+	testSnapshot();
+	testConcurrentVarTable();
+	testMultiFileBatch();
+	testPipeline();
+	testLatencyRecorder();
+	testExpressionLibrary();
+	testConstexprEval();
+	testScopedVarTable();
+	testFastPath();
+	testBinaryOutput();
+	testMappedFile();
+	testBatchEval("base * (1 + rate)");
+	testBatchEval("sqrt(base) - base % 7 + rate / 2");
+	testBatchEval("max(base % 5, rate) + pow(rate + 1, 2)");
 	cout << "-----------------------------------------" << endl;
 }
 
+// Returns true when standard input is an interactive terminal rather
+// than a pipe or a redirected file
+bool stdinIsInteractive() {
+#ifdef _MSC_VER
+	return _isatty(_fileno(stdin)) != 0;
+#else
+	return isatty(fileno(stdin)) != 0;
+#endif
+}
+
+
 void printHelp() {
 	cout << "Type floating point expressions with operators +, -, *, / and %." << endl;
 	cout << "Use 'sqrt' to compute a square root, e.g. 'sqrt(4)'." << endl;
 	cout << "Define a variable with the following syntax: 'let x = 5'" << endl;
 	cout << "You can then use a variable you defined in subsequent expressions." << endl;
+	cout << "Type 'stats' to print the per-line latency histogram." << endl;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
 	//test();
-	cout << endl << "Command line calculator." << endl;
-	cout << "Type 'q' to exit, type 'h' for help." << endl << endl;
-
 	VarTable varTable;
 	varTable.define("pi", 3.1415926535);
 	varTable.define("e", 2.7182818284);
 
+	bool parallel = false;
+	bool pipeline = false;
+	bool binary = false;
+	vector<string> inputPaths;
+	const char* snapshotPath = nullptr;
+	const char* indexPath = nullptr;
+	const char* compileLibraryPath = nullptr;
+	const char* libraryPath = nullptr;
+	for (int i = 1; i < argc; ++i) {
+		if (string(argv[i]) == "--parallel") {
+			parallel = true;
+		}
+		else if (string(argv[i]) == "--pipeline") {
+			pipeline = true;
+		}
+		else if (string(argv[i]) == "--binary") {
+			binary = true;
+		}
+		else if (string(argv[i]) == "--index" && i + 1 < argc) {
+			binary = true;
+			indexPath = argv[++i];
+		}
+		else if (string(argv[i]) == "--snapshot" && i + 1 < argc) {
+			snapshotPath = argv[++i];
+		}
+		else if (string(argv[i]) == "--compile-library" && i + 1 < argc) {
+			compileLibraryPath = argv[++i];
+		}
+		else if (string(argv[i]) == "--library" && i + 1 < argc) {
+			libraryPath = argv[++i];
+		}
+		else {
+			inputPaths.push_back(argv[i]);
+		}
+	}
+
+	// the offline step of the expression library: compile the formula file
+	// into a blob and exit
+	if (compileLibraryPath != nullptr) {
+		if (inputPaths.size() != 1) {
+			cerr << "Expected exactly one formula file to compile." << endl;
+			return 1;
+		}
+		try {
+			ExpressionLibrary::compileFile(inputPaths[0], compileLibraryPath);
+		}
+		catch (runtime_error& e) {
+			cerr << e.what() << endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	// binary results go to stdout as raw bytes; on Windows the stream must
+	// leave text mode first
+	ofstream indexFile;
+	ostream* index = nullptr;
+	if (binary) {
+#ifdef _MSC_VER
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		if (indexPath != nullptr) {
+			indexFile.open(indexPath, ios::binary);
+			if (!indexFile) {
+				cerr << "Cannot write index file '" << indexPath << "'" << endl;
+				return 1;
+			}
+			index = &indexFile;
+		}
+	}
+
+	// warm-start from the previous session's state; a missing snapshot file
+	// is simply a cold start
+	if (snapshotPath != nullptr) {
+		try {
+			loadSnapshot(snapshotPath, varTable);
+		}
+		catch (runtime_error& e) {
+			cerr << e.what() << endl;
+			return 1;
+		}
+	}
+
+	// the parallel and pipeline drivers (and the multi-file pool) compile on
+	// their own paths that do not consult the library; reject the combination
+	// instead of quietly computing different results
+	if (libraryPath != nullptr
+			&& (parallel || pipeline || inputPaths.size() > 1)) {
+		cerr << "--library cannot be combined with --parallel, --pipeline"
+			" or several input files." << endl;
+		return 1;
+	}
+
+	// the precompiled formula library maps in up front; its formulas stay
+	// unevaluated until a line first references them
+	unique_ptr<ExpressionLibrary> library;
+	if (libraryPath != nullptr) {
+		try {
+			library = make_unique<ExpressionLibrary>(libraryPath, varTable.getInterner());
+		}
+		catch (runtime_error& e) {
+			cerr << e.what() << endl;
+			return 1;
+		}
+	}
+
+	// expression files given on the command line are processed from
+	// read-only memory mappings, with no per-line copies; several files are
+	// spread over a work-stealing pool, each as its own session
+	if (!inputPaths.empty()) {
+		try {
+			if (inputPaths.size() == 1) {
+				if (pipeline) {
+					runPipelineBatch(inputPaths[0], cout);
+				}
+				else if (binary) {
+					BinaryResultSink sink{ cout, index };
+					runBatchFile(inputPaths[0], varTable, sink, library.get());
+				}
+				else {
+					TextResultSink sink;
+					runBatchFile(inputPaths[0], varTable, sink, library.get());
+				}
+				if (snapshotPath != nullptr) {
+					saveSnapshot(snapshotPath, varTable);
+				}
+			}
+			else {
+				runMultiFileBatch(inputPaths, cout, thread::hardware_concurrency());
+			}
+		}
+		catch (runtime_error& e) {
+			cerr << e.what() << endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	// piped or redirected input is processed in a throughput-oriented
+	// batch mode with no prompt
+	if (!stdinIsInteractive()) {
+		if (parallel) {
+			ios::sync_with_stdio(false);
+			cin.tie(nullptr);
+			runParallelBatch(cin, cout, varTable, thread::hardware_concurrency());
+		}
+		else if (binary) {
+			BinaryResultSink sink{ cout, index };
+			runBatch(varTable, sink, library.get());
+		}
+		else {
+			TextResultSink sink;
+			runBatch(varTable, sink, library.get());
+		}
+		if (snapshotPath != nullptr) {
+			saveSnapshot(snapshotPath, varTable);
+		}
+		return 0;
+	}
+
+	cout << endl << "Command line calculator." << endl;
+	cout << "Type 'q' to exit, type 'h' for help." << endl << endl;
+
+	// one tokenizer instance persists across the whole session; each line
+	// only rewinds it, so short expressions pay no per-line stream and
+	// tokenizer construction
+	LineTokenizer tokenizer{ "", varTable.getInterner() };
+
+	// every prompt line is timed against the tail-latency budget; lines
+	// above roughly a millisecond get their source text captured
+	LatencyRecorder latencyRecorder{ 1ull << 22 };
+
 	while (cin) {
 		cout << prompt;
 
@@ -305,19 +1667,43 @@ int main() {
 		else if (input == "h" || input == "H") {
 			printHelp();
 		}
+		else if (input == "stats") {
+			latencyRecorder.dump(stdout);
+		}
 		else {
-			// read and process a single line of standard input
-			istringstream inputStream(input);
-			TokenStream ts(inputStream);
+			// process a single line of standard input
+			tokenizer.reset(input);
 
+			uint64_t startCycles = latencyRecorder.start();
 			try {
-				cout << msgResult << calculation(ts, varTable) << endl;
+				// library formulas referenced by this line are evaluated and
+				// defined on first use
+				if (library != nullptr) {
+					Token token = tokenizer.tryGet();
+					while (token.kind != TokenType::INPUT_EOF
+							&& token.kind != TokenType::UNKNOWN) {
+						if (token.kind == TokenType::NAME) {
+							library->resolve(token.symbol, varTable);
+						}
+						token = tokenizer.tryGet();
+					}
+					tokenizer.reset(input);
+				}
+
+				cout << msgResult << calculation(tokenizer, varTable) << endl;
 			}
 			catch (runtime_error& e) {
 				cerr << e.what() << endl;
 			}
+			latencyRecorder.record(startCycles, input);
 		}
 	}
 
+	if (latencyRecorder.totalCount() > 0) {
+		latencyRecorder.dump(stderr);
+	}
+	if (snapshotPath != nullptr) {
+		saveSnapshot(snapshotPath, varTable);
+	}
 	return 0;
 }
\ No newline at end of file
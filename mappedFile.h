@@ -0,0 +1,149 @@
+// Contains read-only memory mapping of an input file and zero-copy iteration
+// over its lines. Batch mode maps the whole expression file at once and hands
+// out string_view lines straight from the mapping, so no line is ever copied
+// and the OS handles readahead.
+#pragma once
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#ifdef _MSC_VER
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// A whole file mapped read-only into memory. The mapping lives until the
+// object is destroyed; every string_view handed out of it is invalidated
+// then.
+class MappedFile {
+private:
+	const char* mapped;
+	size_t length;
+
+#ifdef _MSC_VER
+	HANDLE file;
+	HANDLE mapping;
+#endif
+
+public:
+	MappedFile(const string& path) :mapped(nullptr), length(0) {
+#ifdef _MSC_VER
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			throw runtime_error("Cannot open input file '" + path + "'");
+		}
+
+		LARGE_INTEGER size;
+		GetFileSizeEx(file, &size);
+		length = static_cast<size_t>(size.QuadPart);
+		mapping = nullptr;
+
+		// an empty file maps to an empty range; CreateFileMapping would fail
+		if (length > 0) {
+			mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping == nullptr) {
+				CloseHandle(file);
+				throw runtime_error("Cannot map input file '" + path + "'");
+			}
+			mapped = static_cast<const char*>(
+				MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+			if (mapped == nullptr) {
+				CloseHandle(mapping);
+				CloseHandle(file);
+				throw runtime_error("Cannot map input file '" + path + "'");
+			}
+		}
+#else
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw runtime_error("Cannot open input file '" + path + "'");
+		}
+
+		struct stat info;
+		if (fstat(fd, &info) != 0) {
+			close(fd);
+			throw runtime_error("Cannot open input file '" + path + "'");
+		}
+		length = static_cast<size_t>(info.st_size);
+
+		// an empty file maps to an empty range; mmap rejects a zero length
+		if (length > 0) {
+			void* address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (address == MAP_FAILED) {
+				close(fd);
+				throw runtime_error("Cannot map input file '" + path + "'");
+			}
+			mapped = static_cast<const char*>(address);
+		}
+
+		// the mapping keeps its own reference to the file
+		close(fd);
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile() {
+#ifdef _MSC_VER
+		if (mapped != nullptr) {
+			UnmapViewOfFile(mapped);
+			CloseHandle(mapping);
+		}
+		CloseHandle(file);
+#else
+		if (mapped != nullptr) {
+			munmap(const_cast<char*>(mapped), length);
+		}
+#endif
+	}
+
+	const char* data() const {
+		return mapped;
+	}
+
+	size_t size() const {
+		return length;
+	}
+};
+
+// Walks the mapped bytes line by line, returning each line as a string_view
+// into the mapping (no copies). Handles '\n' and '\r\n' endings and a final
+// line without a terminator.
+class MappedLineReader {
+private:
+	const char* pos;
+	const char* end;
+
+public:
+	MappedLineReader(const MappedFile& file)
+		:pos(file.data()), end(file.data() + file.size()) {}
+
+	// Fetches the next line; returns false at the end of the file
+	bool next(string_view& line) {
+		if (pos == end) {
+			return false;
+		}
+
+		const char* lineStart = pos;
+		const char* newline = static_cast<const char*>(
+			memchr(pos, '\n', end - pos));
+		pos = newline == nullptr ? end : newline + 1;
+
+		size_t lineLength = (newline == nullptr ? end : newline) - lineStart;
+		if (lineLength > 0 && lineStart[lineLength - 1] == '\r') {
+			--lineLength;
+		}
+		line = string_view(lineStart, lineLength);
+		return true;
+	}
+};
@@ -0,0 +1,187 @@
+// Contains a parallel driver for batch input: statements are compiled up
+// front, analyzed for variable definitions, and runs of independent
+// statements between 'let' declarations are evaluated across worker threads.
+#pragma once
+#include <atomic>
+#include <cstdio>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "compiledExpression.h"
+#include "lineTokenizer.h"
+#include "variable.h"
+
+using namespace std;
+
+// One input line prepared for evaluation, holding every statement on it like
+// calculation() would process; failed/error describe a compile- or eval-time
+// error.
+class BatchLine {
+public:
+	vector<CompiledStatement> statements;
+	double result;
+	bool failed;
+	string error;
+
+	BatchLine() :result(0.0), failed(false) {}
+
+	// Returns whether any statement on the line writes to the table
+	bool defines() const {
+		for (const CompiledStatement& statement : statements) {
+			if (statement.defineSymbol >= 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+// Evaluates lines [begin, end), all of which only read from the table, by
+// splitting them across worker threads. Results and per-line errors are
+// stored back into the lines, preserving input order.
+inline void evaluateRunParallel(vector<BatchLine>& lines, size_t begin, size_t end,
+		const VarTable& varTable, unsigned threadCount) {
+	const size_t chunkSize = 64;
+	atomic<size_t> nextChunk{ begin };
+
+	auto worker = [&] {
+		while (true) {
+			size_t chunkBegin = nextChunk.fetch_add(chunkSize);
+			if (chunkBegin >= end) {
+				break;
+			}
+			size_t chunkEnd = min(chunkBegin + chunkSize, end);
+
+			for (size_t i = chunkBegin; i < chunkEnd; ++i) {
+				BatchLine& line = lines[i];
+				if (line.failed) {
+					continue;
+				}
+				try {
+					for (const CompiledStatement& statement : line.statements) {
+						line.result = statement.expr.eval(varTable);
+					}
+				}
+				catch (runtime_error& e) {
+					line.failed = true;
+					line.error = e.what();
+				}
+			}
+		}
+	};
+
+	if (threadCount <= 1 || end - begin < 2 * chunkSize) {
+		worker();
+		return;
+	}
+
+	vector<thread> workers;
+	for (unsigned i = 0; i < threadCount; ++i) {
+		workers.emplace_back(worker);
+	}
+	for (thread& t : workers) {
+		t.join();
+	}
+}
+
+// Reads all statements from the input, evaluates them with the sequential
+// semantics of calculation() in main.cpp, and writes the results to the
+// output in input order. Lines without a 'let' only read variables and are
+// therefore independent of each other; such runs are spread across
+// threadCount worker threads. Lines with declarations write to the table
+// and act as barriers evaluated on the calling thread. The input is
+// processed in bounded segments so that arbitrarily large batches never
+// buffer whole in memory.
+inline void runParallelBatch(istream& input, ostream& output, VarTable& varTable,
+		unsigned threadCount) {
+	const size_t segmentSize = 4096;
+
+	vector<BatchLine> lines;
+	string text;
+	string outputBuffer;
+	LineTokenizer tokenizer{ "", varTable.getInterner() };
+
+	// each segment's statements share one arena, rewound between segments
+	Arena arena;
+	ExpressionCompiler compiler{ arena };
+
+	bool more = true;
+	while (more) {
+		lines.clear();
+		arena.reset();
+
+		// compile one segment up front; interning is not thread safe, so
+		// this stays on one thread
+		while (lines.size() < segmentSize
+				&& (more = static_cast<bool>(getline(input, text)))) {
+			tokenizer.reset(text);
+			lines.emplace_back();
+			BatchLine& line = lines.back();
+			try {
+				// every statement on the line, mirroring calculation()
+				Token token{ TokenType::INPUT_EOF };
+				do {
+					line.statements.push_back(compiler.compileStatement(
+						tokenizer, varTable.getInterner()));
+					token = tokenizer.get();
+					if (token.kind != TokenType::INPUT_EOF) {
+						tokenizer.putback(token);
+					}
+				} while (token.kind != TokenType::INPUT_EOF);
+			}
+			catch (runtime_error& e) {
+				line.statements.clear();
+				line.failed = true;
+				line.error = e.what();
+			}
+		}
+
+		// evaluate: parallel runs of reads, sequential declarations between
+		size_t i = 0;
+		while (i < lines.size()) {
+			if (!lines[i].failed && lines[i].defines()) {
+				try {
+					for (const CompiledStatement& statement : lines[i].statements) {
+						lines[i].result = statement.eval(varTable);
+					}
+				}
+				catch (runtime_error& e) {
+					lines[i].failed = true;
+					lines[i].error = e.what();
+				}
+				++i;
+				continue;
+			}
+
+			size_t runEnd = i;
+			while (runEnd < lines.size()
+					&& (lines[runEnd].failed || !lines[runEnd].defines())) {
+				++runEnd;
+			}
+			evaluateRunParallel(lines, i, runEnd, varTable, threadCount);
+			i = runEnd;
+		}
+
+		// report the segment in input order and flush it out
+		for (const BatchLine& line : lines) {
+			if (line.failed) {
+				outputBuffer += line.error;
+				outputBuffer += '\n';
+			}
+			else {
+				char formatted[32];
+				int length = snprintf(formatted, sizeof(formatted), "%g", line.result);
+				outputBuffer += "= ";
+				outputBuffer.append(formatted, length);
+				outputBuffer += '\n';
+			}
+		}
+		output << outputBuffer;
+		outputBuffer.clear();
+	}
+	output.flush();
+}
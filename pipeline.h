@@ -0,0 +1,316 @@
+// Contains an asynchronous three-stage pipeline for huge batch inputs:
+// one thread tokenizes, one compiles statements to bytecode, and the
+// calling thread evaluates - connected by bounded lock-free single-producer
+// single-consumer ring buffers carrying compact token vectors and compiled
+// programs. The single-threaded batch loop interleaves all three stages on
+// one core with poor instruction-cache behavior; here each stage's working
+// set stays hot and file I/O stalls overlap with compute. The interner is
+// written only by the tokenize stage, so the later stages never touch it:
+// the compile stage validates declarations itself with name-free messages
+// and the evaluate stage resolves variables against its own flat bindings.
+#pragma once
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "arena.h"
+#include "bytecode.h"
+#include "compiledExpression.h"
+#include "lineTokenizer.h"
+#include "mappedFile.h"
+#include "variable.h"
+
+using namespace std;
+
+// A bounded lock-free queue for exactly one producer and one consumer.
+// Indices only ever grow and are masked into the power-of-two slot array;
+// the producer owns tail, the consumer owns head.
+template <typename T>
+class SpscRing {
+private:
+	static const size_t capacity = 1024;
+
+	vector<T> slots;
+	atomic<size_t> head{ 0 };
+	atomic<size_t> tail{ 0 };
+
+public:
+	SpscRing() :slots(capacity) {}
+
+	// Producer side; returns false when the ring is full
+	bool tryPush(T& item) {
+		size_t t = tail.load(memory_order_relaxed);
+		if (t - head.load(memory_order_acquire) == capacity) {
+			return false;
+		}
+		slots[t & (capacity - 1)] = move(item);
+		tail.store(t + 1, memory_order_release);
+		return true;
+	}
+
+	// Consumer side; returns false when the ring is empty
+	bool tryPop(T& out) {
+		size_t h = head.load(memory_order_relaxed);
+		if (tail.load(memory_order_acquire) == h) {
+			return false;
+		}
+		out = move(slots[h & (capacity - 1)]);
+		head.store(h + 1, memory_order_release);
+		return true;
+	}
+};
+
+// One line's tokens, produced by the tokenize stage
+class TokenizedLine {
+public:
+	vector<Token> tokens;
+};
+
+// One statement of a line lowered to bytecode; defineSymbol mirrors
+// CompiledStatement
+class CompiledProgram {
+public:
+	int defineSymbol = -1;
+	BytecodeProgram program;
+};
+
+// One line's compiled statements (or its compile error), produced by the
+// compile stage
+class CompiledLine {
+public:
+	vector<CompiledProgram> statements;
+	string error;
+};
+
+// Replays a token vector through the tokenizer interface the compiler
+// expects; the UNKNOWN token throws exactly like LineTokenizer::get()
+class TokenBufferStream {
+private:
+	const vector<Token>& tokens;
+	size_t pos = 0;
+	bool bufferFull = false;
+	Token buffer{ TokenType::INPUT_EOF };
+
+public:
+	TokenBufferStream(const vector<Token>& tokens) :tokens(tokens) {}
+
+	Token get() {
+		if (bufferFull) {
+			bufferFull = false;
+			return buffer;
+		}
+		if (pos >= tokens.size()) {
+			return Token{ TokenType::INPUT_EOF };
+		}
+		Token token = tokens[pos++];
+		if (token.kind == TokenType::UNKNOWN) {
+			throw runtime_error("Unexpected token.");
+		}
+		return token;
+	}
+
+	void putback(Token token) {
+		bufferFull = true;
+		buffer = token;
+	}
+};
+
+// The evaluate stage's own flat bindings. Lookups never touch the interner
+// (it belongs to the tokenize stage), so the undefined-variable message
+// cannot carry the name.
+class PipelineVarTable {
+private:
+	vector<double> values;
+	vector<char> isDefined;
+
+public:
+	double get(int id) const {
+		if (id < 0 || id >= static_cast<int>(values.size()) || !isDefined[id]) {
+			throw runtime_error("Undefined variable");
+		}
+		return values[id];
+	}
+
+	void define(int id, double value) {
+		if (id >= static_cast<int>(values.size())) {
+			values.resize(id + 1, 0.0);
+			isDefined.resize(id + 1, 0);
+		}
+		values[id] = value;
+		isDefined[id] = 1;
+	}
+};
+
+// The pipeline itself: stage threads, the rings between them, and the
+// end-of-input flags each producer raises after its last push
+class BatchPipeline {
+private:
+	SpscRing<TokenizedLine> tokenRing;
+	SpscRing<CompiledLine> programRing;
+	atomic<bool> tokenizeDone{ false };
+	atomic<bool> compileDone{ false };
+
+	NameInterner interner;
+	PipelineVarTable varTable;
+
+	// Stage one: reads the mapped file line by line and pushes each line's
+	// tokens; the only stage that writes the interner
+	void tokenizeStage(const MappedFile& file) {
+		MappedLineReader reader{ file };
+		LineTokenizer tokenizer{ "", interner };
+		string_view line;
+		TokenizedLine item;
+
+		while (reader.next(line)) {
+			tokenizer.reset(line);
+			item.tokens.clear();
+			Token token{ TokenType::INPUT_EOF };
+			do {
+				token = tokenizer.tryGet();
+				item.tokens.push_back(token);
+			} while (token.kind != TokenType::INPUT_EOF
+				&& token.kind != TokenType::UNKNOWN);
+
+			while (!tokenRing.tryPush(item)) {
+				this_thread::yield();
+			}
+		}
+		tokenizeDone.store(true, memory_order_release);
+	}
+
+	// Compiles every statement of one token vector, mirroring calculation(),
+	// validating declarations with name-free messages so the interner stays
+	// untouched
+	CompiledLine compileLine(const TokenizedLine& item, Arena& arena,
+			ExpressionCompiler& compiler) {
+		CompiledLine compiled;
+		TokenBufferStream ts{ item.tokens };
+		arena.reset();
+
+		try {
+			Token token = ts.get();
+			do {
+				CompiledProgram statement;
+				if (token.kind == TokenType::KW_LET) {
+					token = ts.get();
+					if (token.kind != TokenType::NAME) {
+						throw runtime_error("Expected a variable name after 'let' keyword.");
+					}
+					statement.defineSymbol = token.symbol;
+					if (ts.get().kind != TokenType::EQUALS) {
+						throw runtime_error("Missing '=' in a declaration");
+					}
+				}
+				else {
+					ts.putback(token);
+				}
+
+				statement.program = BytecodeCompiler{}.compile(compiler.compile(ts));
+				compiled.statements.push_back(move(statement));
+				token = ts.get();
+			} while (token.kind != TokenType::INPUT_EOF);
+		}
+		catch (runtime_error& e) {
+			compiled.statements.clear();
+			compiled.error = e.what();
+		}
+		return compiled;
+	}
+
+	// Stage two: pops token vectors, compiles them, pushes programs
+	void compileStage() {
+		Arena arena;
+		ExpressionCompiler compiler{ arena };
+		TokenizedLine item;
+
+		while (true) {
+			if (!tokenRing.tryPop(item)) {
+				if (!tokenizeDone.load(memory_order_acquire)) {
+					this_thread::yield();
+					continue;
+				}
+				// drain what the producer pushed before raising the flag
+				if (!tokenRing.tryPop(item)) {
+					break;
+				}
+			}
+
+			CompiledLine compiled = compileLine(item, arena, compiler);
+			while (!programRing.tryPush(compiled)) {
+				this_thread::yield();
+			}
+		}
+		compileDone.store(true, memory_order_release);
+	}
+
+	// Stage three (the calling thread): pops programs, evaluates them and
+	// writes one result line each, in input order by construction
+	void evaluateStage(ostream& output) {
+		CompiledLine compiled;
+
+		while (true) {
+			if (!programRing.tryPop(compiled)) {
+				if (!compileDone.load(memory_order_acquire)) {
+					this_thread::yield();
+					continue;
+				}
+				// drain what the producer pushed before raising the flag
+				if (!programRing.tryPop(compiled)) {
+					break;
+				}
+			}
+
+			if (!compiled.error.empty()) {
+				output << compiled.error << '\n';
+				continue;
+			}
+
+			try {
+				double value = 0.0;
+				for (const CompiledProgram& statement : compiled.statements) {
+					value = statement.program.eval(varTable);
+					if (statement.defineSymbol >= 0) {
+						varTable.define(statement.defineSymbol, value);
+					}
+				}
+
+				char formatted[32];
+				int length = snprintf(formatted, sizeof(formatted), "= %g", value);
+				output.write(formatted, length);
+				output << '\n';
+			}
+			catch (runtime_error& e) {
+				output << e.what() << '\n';
+			}
+		}
+	}
+
+public:
+	// Processes the whole file through the three stages and writes one
+	// result line per input line
+	void run(const string& path, ostream& output) {
+		MappedFile file{ path };
+
+		// the session constants main() seeds, interned before any stage runs
+		varTable.define(interner.intern("pi"), 3.1415926535);
+		varTable.define(interner.intern("e"), 2.7182818284);
+
+		thread tokenizer{ [this, &file] { tokenizeStage(file); } };
+		thread compiler{ [this] { compileStage(); } };
+		evaluateStage(output);
+
+		tokenizer.join();
+		compiler.join();
+		output.flush();
+	}
+};
+
+// Evaluates the file through the tokenize/compile/evaluate pipeline
+inline void runPipelineBatch(const string& path, ostream& output) {
+	BatchPipeline{}.run(path, output);
+}
@@ -0,0 +1,111 @@
+// Contains a memoization cache for whole input lines. The key is the
+// canonical token sequence of the line plus the current values of the
+// variables it references, so a formula that is re-submitted with unchanged
+// inputs skips tokenizing into a parse and evaluation entirely.
+#pragma once
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include "lineTokenizer.h"
+#include "variable.h"
+
+using namespace std;
+
+// Builds the canonical cache key of the line into 'key' (reused between
+// calls to avoid allocation churn): one byte of token kind plus the binary
+// payload per token, followed by the binary values of all referenced
+// variables. Returns false when the line must not be cached - it contains a
+// declaration (which has a side effect), a scan error, or an undefined
+// variable (so the normal path reports the error).
+inline bool buildCacheKey(string_view line, VarTable& varTable, string& key) {
+	key.clear();
+	LineTokenizer tokenizer(line, varTable.getInterner());
+
+	while (true) {
+		Token token = tokenizer.tryGet();
+		if (token.kind == TokenType::INPUT_EOF) {
+			break;
+		}
+
+		switch (token.kind) {
+		case TokenType::KW_LET:
+		case TokenType::UNKNOWN:
+			return false;
+		case TokenType::NUMBER:
+			key += static_cast<char>(token.kind);
+			key.append(reinterpret_cast<const char*>(&token.value), sizeof(token.value));
+			break;
+		case TokenType::NAME: {
+			double value;
+			if (!varTable.tryGet(token.symbol, value)) {
+				return false;
+			}
+			key += static_cast<char>(token.kind);
+			key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+			break;
+		}
+		case TokenType::FUNC:
+			// calls to different functions must never share a key
+			key += static_cast<char>(token.kind);
+			key.append(reinterpret_cast<const char*>(&token.symbol), sizeof(token.symbol));
+			break;
+		default:
+			key += static_cast<char>(token.kind);
+			break;
+		}
+	}
+
+	return true;
+}
+
+// Bounded LRU map from canonical line keys to results. Lookup and insert are
+// one hash map operation plus a list splice; the least recently used entry
+// is evicted when the capacity is reached.
+class ResultCache {
+private:
+	size_t capacity;
+
+	// most recently used entries at the front; the map references the key
+	// strings stored in the list nodes, which stay stable under splice
+	list<pair<string, double>> entries;
+	unordered_map<string_view, list<pair<string, double>>::iterator> index;
+
+public:
+	long long hits;
+	long long misses;
+
+	ResultCache(size_t capacity) :capacity(capacity), hits(0), misses(0) {}
+
+	// Looks the key up, refreshing its LRU position on a hit
+	bool lookup(const string& key, double& out) {
+		auto found = index.find(key);
+		if (found == index.end()) {
+			++misses;
+			return false;
+		}
+
+		entries.splice(entries.begin(), entries, found->second);
+		out = entries.front().second;
+		++hits;
+		return true;
+	}
+
+	// Stores the result for the key, evicting the least recently used entry
+	// when full
+	void insert(const string& key, double value) {
+		if (index.find(key) != index.end()) {
+			return;
+		}
+
+		if (entries.size() >= capacity) {
+			index.erase(string_view(entries.back().first));
+			entries.pop_back();
+		}
+
+		entries.emplace_front(key, value);
+		index.emplace(string_view(entries.front().first), entries.begin());
+	}
+};
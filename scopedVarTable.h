@@ -0,0 +1,117 @@
+// Contains a layered variable environment for what-if scenarios. A scenario
+// pushes a scope, shadows any number of bindings in it, evaluates, and pops
+// the whole layer again - without re-define()-ing every touched name to roll
+// back. Layers sit over the interned-ID flat table of a shared base VarTable
+// and use generation stamps instead of clearing: popping a layer parks it on
+// a free list and reusing it bumps its generation, which invalidates every
+// old binding at once. Push and pop therefore cost O(1) regardless of how
+// many names the scenario shadowed. Reads check the layers top-down before
+// the base table, so the table mirrors the read interface of VarTable and
+// the compiled evaluators work against it unchanged.
+#pragma once
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "variable.h"
+
+using namespace std;
+
+class ScopedVarTable {
+private:
+	// One scope layer: a binding is live when its stamp matches the layer's
+	// current generation; stale stamps from earlier uses need no cleanup
+	class Layer {
+	public:
+		vector<double> values;
+		vector<uint32_t> definedGen;
+		uint32_t gen = 1;
+
+		bool holds(int id) const {
+			return id >= 0 && id < static_cast<int>(values.size())
+				&& definedGen[id] == gen;
+		}
+
+		void set(int id, double value) {
+			if (id >= static_cast<int>(values.size())) {
+				values.resize(id + 1, 0.0);
+				definedGen.resize(id + 1, 0);
+			}
+			values[id] = value;
+			definedGen[id] = gen;
+		}
+	};
+
+	VarTable& base;
+	vector<Layer> layers;
+	vector<Layer> pool;
+
+public:
+	ScopedVarTable(VarTable& base) :base(base) {}
+
+	NameInterner& getInterner() {
+		return base.getInterner();
+	}
+
+	// Opens a new scope; subsequent defines shadow the layers (and the base
+	// table) below it
+	void push() {
+		if (!pool.empty()) {
+			layers.push_back(move(pool.back()));
+			pool.pop_back();
+			++layers.back().gen;
+		}
+		else {
+			layers.push_back(Layer{});
+		}
+	}
+
+	// Discards the topmost scope and everything defined in it
+	void pop() {
+		if (layers.empty()) {
+			throw runtime_error("No scope to pop.");
+		}
+		pool.push_back(move(layers.back()));
+		layers.pop_back();
+	}
+
+	size_t depth() const {
+		return layers.size();
+	}
+
+	double get(int id) const {
+		for (size_t i = layers.size(); i > 0; --i) {
+			if (layers[i - 1].holds(id)) {
+				return layers[i - 1].values[id];
+			}
+		}
+		return base.get(id);
+	}
+
+	// Non-throwing lookup for the exception-free evaluation path; returns
+	// false when the variable is not defined in any layer or the base
+	bool tryGet(int id, double& out) const {
+		for (size_t i = layers.size(); i > 0; --i) {
+			if (layers[i - 1].holds(id)) {
+				out = layers[i - 1].values[id];
+				return true;
+			}
+		}
+		return base.tryGet(id, out);
+	}
+
+	// Binds the name in the topmost scope; with no scope open it writes
+	// through to the shared base table
+	double define(int id, double value) {
+		if (layers.empty()) {
+			return base.define(id, value);
+		}
+		layers.back().set(id, value);
+		return value;
+	}
+
+	double define(const string& name, double value) {
+		return define(getInterner().intern(name), value);
+	}
+};
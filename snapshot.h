@@ -0,0 +1,136 @@
+// Contains a compact binary snapshot of the session state. A worker saves
+// its variable table on shutdown and restores it on startup with a single
+// bulk read, instead of replaying its whole 'let' history through the
+// parser. Records are fixed width (the names live in one blob behind them),
+// so a snapshot can also be consumed straight out of a memory mapping.
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "variable.h"
+
+using namespace std;
+
+// File layout: SnapshotHeader, then header.count fixed-width
+// SnapshotRecords, then header.namesSize bytes of name characters.
+class SnapshotHeader {
+public:
+	char magic[4];
+	uint32_t version;
+	uint32_t count;
+	uint32_t namesSize;
+};
+
+// One defined variable; the name is the given slice of the name blob
+class SnapshotRecord {
+public:
+	uint32_t nameOffset;
+	uint32_t nameLength;
+	double value;
+};
+
+const char snapshotMagic[4] = { 'C', 'S', 'N', 'P' };
+const uint32_t snapshotVersion = 1;
+
+// Writes every defined variable of the table to the file; throws on I/O
+// failure
+inline void saveSnapshot(const string& path, VarTable& varTable) {
+	NameInterner& interner = varTable.getInterner();
+	vector<SnapshotRecord> records;
+	string names;
+
+	for (int id = 0; id < interner.count(); ++id) {
+		double value;
+		if (!varTable.tryGet(id, value)) {
+			continue;
+		}
+		const string& name = interner.nameOf(id);
+		SnapshotRecord record;
+		record.nameOffset = static_cast<uint32_t>(names.size());
+		record.nameLength = static_cast<uint32_t>(name.size());
+		record.value = value;
+		records.push_back(record);
+		names += name;
+	}
+
+	SnapshotHeader header;
+	memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+	header.version = snapshotVersion;
+	header.count = static_cast<uint32_t>(records.size());
+	header.namesSize = static_cast<uint32_t>(names.size());
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == nullptr) {
+		throw runtime_error("Cannot write snapshot file '" + path + "'");
+	}
+
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1
+		&& (records.empty()
+			|| fwrite(records.data(), sizeof(SnapshotRecord), records.size(), file)
+				== records.size())
+		&& (names.empty()
+			|| fwrite(names.data(), 1, names.size(), file) == names.size());
+	written = fclose(file) == 0 && written;
+
+	if (!written) {
+		throw runtime_error("Cannot write snapshot file '" + path + "'");
+	}
+}
+
+// Defines every variable stored in the snapshot into the table. Returns
+// false when the file does not exist (a cold start); throws when the file
+// exists but is not a valid snapshot.
+inline bool loadSnapshot(const string& path, VarTable& varTable) {
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == nullptr) {
+		return false;
+	}
+
+	SnapshotHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1
+			|| memcmp(header.magic, snapshotMagic, sizeof(header.magic)) != 0
+			|| header.version != snapshotVersion) {
+		fclose(file);
+		throw runtime_error("File '" + path + "' is not a valid snapshot.");
+	}
+
+	// the header's sizes must agree with the actual file size before they
+	// drive an allocation; a corrupt count would otherwise attempt to
+	// allocate gigabytes and die on bad_alloc instead of failing cleanly
+	uint64_t bodySize = static_cast<uint64_t>(header.count) * sizeof(SnapshotRecord)
+		+ header.namesSize;
+	fseek(file, 0, SEEK_END);
+	long fileSize = ftell(file);
+	if (fileSize < 0 || static_cast<uint64_t>(fileSize) < sizeof(header) + bodySize
+			|| fseek(file, sizeof(header), SEEK_SET) != 0) {
+		fclose(file);
+		throw runtime_error("File '" + path + "' is not a valid snapshot.");
+	}
+
+	// one bulk read covers all records and the name blob
+	vector<char> body(static_cast<size_t>(bodySize));
+	if (!body.empty() && fread(body.data(), 1, body.size(), file) != body.size()) {
+		fclose(file);
+		throw runtime_error("File '" + path + "' is not a valid snapshot.");
+	}
+	fclose(file);
+
+	const SnapshotRecord* records = reinterpret_cast<const SnapshotRecord*>(body.data());
+	const char* names = body.data() + header.count * sizeof(SnapshotRecord);
+
+	for (uint32_t i = 0; i < header.count; ++i) {
+		// overflow-safe form: the 32-bit sum of offset and length wraps
+		if (records[i].nameLength > header.namesSize
+				|| records[i].nameOffset > header.namesSize - records[i].nameLength) {
+			throw runtime_error("File '" + path + "' is not a valid snapshot.");
+		}
+		string name(names + records[i].nameOffset, records[i].nameLength);
+		varTable.define(name, records[i].value);
+	}
+
+	return true;
+}
@@ -4,6 +4,8 @@
 #include <vector>
 #include <istream>
 #include <algorithm>
+#include "instrumentation.h"
+#include "variable.h"
 
 using namespace std;
 
@@ -21,23 +23,31 @@ enum class TokenType {
 	KW_LET,
 	EQUALS,
 	NAME,
-	SQRT
+	FUNC,
+	COMMA
 };
 
+// A single scanned token. Deliberately a 16-byte trivially copyable value:
+// the payload is a tagged union, and instead of a name string a NAME token
+// carries the interned ID of the name (see NameInterner in variable.h), so
+// copying a token around and putting it back never touches the allocator.
 class Token {
 public:
 	TokenType kind;
-	double value;
-	string name;
+	union {
+		double value;	// NUMBER: the literal's value
+		int symbol;		// NAME: interned ID of the name; FUNC: functionTable index
+	};
 
-	Token(TokenType type) :kind(type), value(0.0), name("") { }
-	Token(double val) :kind(TokenType::NUMBER), value(val), name("") { }
-	Token(string name) :kind(TokenType::NAME), value(0.0), name(name) { }
+	Token(TokenType type) :kind(type), value(0.0) { }
+	Token(double val) :kind(TokenType::NUMBER), value(val) { }
+	Token(TokenType type, int symbol) :kind(type), symbol(symbol) { }
 };
 
 class TokenStream {
 private:
 	istream& inputStream;
+	NameInterner& interner;
 	bool bufferFull;
 	Token buffer;
 
@@ -67,6 +77,8 @@ private:
 			return Token{ TokenType::RPAREN };
 		case '=':
 			return Token{ TokenType::EQUALS };
+		case ',':
+			return Token{ TokenType::COMMA };
 		case '0':
 		case '1':
 		case '2':
@@ -109,21 +121,26 @@ private:
 			}
 		}
 
-		if (name == "let") {
+		// one intern resolves keyword, function and variable names alike
+		int symbol = interner.intern(name);
+		if (interner.isLetKeyword(symbol)) {
 			return Token{ TokenType::KW_LET };
 		}
-		else if (name == "sqrt") {
-			return Token{ TokenType::SQRT };
+		int func = interner.functionOf(symbol);
+		if (func >= 0) {
+			return Token{ TokenType::FUNC, func };
 		}
 
-		return Token{ name };
+		return Token{ TokenType::NAME, symbol };
 	}
 public:
-	TokenStream(istream& inputStream)
-		:inputStream(inputStream), bufferFull(false), buffer(Token{ TokenType::INPUT_EOF }) {}
+	TokenStream(istream& inputStream, NameInterner& interner)
+		:inputStream(inputStream), interner(interner), bufferFull(false),
+		buffer(Token{ TokenType::INPUT_EOF }) {}
 	
 	// Gets the next token
 	Token get() {
+		CALC_PROFILE_SCOPE(PROFILE_TOKEN_GET);
 		if (bufferFull) {
 			bufferFull = false;
 			return buffer;
@@ -1,51 +1,142 @@
 #pragma once
 #include<string>
+#include<string_view>
 #include<vector>
+#include<map>
+#include<stdexcept>
+#include "functionRegistry.h"
+#include "instrumentation.h"
 
 
 using namespace std;
 
-class Variable {
+// Maps variable names to small consecutive integer IDs. A name is interned
+// once (typically when it is tokenized) and every later reference carries the
+// ID, so lookups on the evaluation hot path never compare strings.
+class NameInterner {
+private:
+	// less<> enables lookups by string_view without building a string
+	map<string, int, less<>> ids;
+	vector<string> names;
+
+	int letSymbol;
+
+	// interned ID -> index into functionTable, -1 for everything else
+	vector<int> functions;
+
 public:
-	string name;
-	double value;
-};
+	// The keyword and every registered function name are interned up front,
+	// so classifying a scanned name costs one intern() plus two array loads -
+	// no string comparison chain grows with the registry.
+	NameInterner() {
+		letSymbol = intern("let");
+		for (int i = 0; i < functionCount; ++i) {
+			intern(functionTable[i].name);
+		}
+		functions.assign(names.size(), -1);
+		for (int i = 0; i < functionCount; ++i) {
+			functions[find(functionTable[i].name)] = i;
+		}
+	}
 
-class VarTable {
-private:
-	vector<Variable> variables;
+	// Returns whether the symbol is the 'let' keyword
+	bool isLetKeyword(int symbol) const {
+		return symbol == letSymbol;
+	}
+
+	// Returns the functionTable index of the symbol, or -1 when it does not
+	// name a registered function
+	int functionOf(int symbol) const {
+		return symbol < static_cast<int>(functions.size()) ? functions[symbol] : -1;
+	}
 
-	Variable* getVariable(string name) {
-		for (Variable& var : variables) {
-			if (var.name == name) {
-				return &var;
-			}
+	// Returns the ID of the given name, assigning the next free ID if the
+	// name has not been seen before
+	int intern(string_view name) {
+		auto found = ids.find(name);
+		if (found != ids.end()) {
+			return found->second;
 		}
 
-		return nullptr;
+		int id = static_cast<int>(names.size());
+		names.emplace_back(name);
+		ids.emplace(names.back(), id);
+		return id;
+	}
+
+	// Returns the ID of the given name, or -1 if it has never been interned
+	int find(string_view name) const {
+		auto found = ids.find(name);
+		return found != ids.end() ? found->second : -1;
+	}
+
+	// Returns the name interned under the given ID
+	const string& nameOf(int id) const {
+		return names[id];
 	}
 
+	int count() const {
+		return static_cast<int>(names.size());
+	}
+};
+
+// Table of variable bindings. Values live in a flat array indexed by the
+// interned ID of the name, so get(id) on the evaluation hot path is a single
+// array load. The string-based overloads remain for callers that have not
+// interned their names (e.g. the istream-based TokenStream front end).
+class VarTable {
+private:
+	NameInterner interner;
+	vector<double> values;
+	vector<char> isDefined;
+
 public:
+	// Exposes the interner so that a tokenizer can map names to IDs while
+	// scanning
+	NameInterner& getInterner() {
+		return interner;
+	}
 
-	double get(string name) {
-		for (const Variable& var : variables) {
-			if (name == var.name) {
-				return var.value;
-			}
+	double get(int id) const {
+		CALC_PROFILE_SCOPE(PROFILE_VAR_GET);
+		if (id < 0) {
+			throw runtime_error("Undefined variable");
 		}
-
-		throw runtime_error("Undefined variable '" + name + "'");
+		if (id >= static_cast<int>(values.size()) || !isDefined[id]) {
+			throw runtime_error("Undefined variable '" + interner.nameOf(id) + "'");
+		}
+		return values[id];
 	}
 
-	double define(string name, double value) {
-		Variable *var = getVariable(name);
-		if (var == nullptr) {
-			variables.push_back(Variable{ name, value });
+	// Non-throwing lookup for the exception-free evaluation path; returns
+	// false when the variable is not defined
+	bool tryGet(int id, double& out) const {
+		if (id < 0 || id >= static_cast<int>(values.size()) || !isDefined[id]) {
+			return false;
 		}
-		else {
-			var->value = value;
+		out = values[id];
+		return true;
+	}
+
+	double get(const string& name) const {
+		int id = interner.find(name);
+		if (id < 0) {
+			throw runtime_error("Undefined variable '" + name + "'");
 		}
+		return get(id);
+	}
 
+	double define(int id, double value) {
+		if (id >= static_cast<int>(values.size())) {
+			values.resize(id + 1, 0.0);
+			isDefined.resize(id + 1, 0);
+		}
+		values[id] = value;
+		isDefined[id] = 1;
 		return value;
 	}
-};
\ No newline at end of file
+
+	double define(const string& name, double value) {
+		return define(interner.intern(name), value);
+	}
+};
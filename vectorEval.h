@@ -0,0 +1,218 @@
+// Contains batched evaluation of one bytecode program against many rows of
+// variable data. Variables are bound to contiguous columns of doubles and
+// the interpreter processes four rows per instruction with AVX2 where
+// available (scalar fallback otherwise), including a vectorized sqrt.
+//
+// Unlike the scalar evaluators, batched evaluation follows IEEE arithmetic
+// throughout: division by zero and sqrt of a negative number produce
+// infinities/NaNs in the affected rows instead of throwing, since per-lane
+// error checks would serialize the whole batch.
+#pragma once
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "bytecode.h"
+#include "functionRegistry.h"
+
+using namespace std;
+
+// Columnar variable bindings: one contiguous array of values per variable,
+// all with the same number of rows.
+class ColumnTable {
+private:
+	vector<vector<double>> columns;
+	size_t rowCount;
+
+public:
+	ColumnTable(size_t rowCount) :rowCount(rowCount) {}
+
+	// Binds the column of values (one per row) to the variable with the
+	// given symbol ID
+	void setColumn(int symbol, vector<double> values) {
+		if (values.size() != rowCount) {
+			throw runtime_error("Column size does not match the row count.");
+		}
+		if (symbol >= static_cast<int>(columns.size())) {
+			columns.resize(symbol + 1);
+		}
+		columns[symbol] = move(values);
+	}
+
+	// Binds the same value to every row of the variable
+	void setBroadcast(int symbol, double value) {
+		setColumn(symbol, vector<double>(rowCount, value));
+	}
+
+	const double* column(int symbol) const {
+		if (symbol < 0 || symbol >= static_cast<int>(columns.size())
+				|| columns[symbol].empty()) {
+			throw runtime_error("Variable with ID " + to_string(symbol)
+				+ " has no bound column.");
+		}
+		return columns[symbol].data();
+	}
+
+	size_t rows() const {
+		return rowCount;
+	}
+};
+
+// Evaluates the program once per row of the bound columns, writing one value
+// per row into results (which must point to rows() doubles).
+inline void evalBatch(const BytecodeProgram& program, const ColumnTable& vars,
+		double* results) {
+	const vector<Instruction>& code = program.instructions();
+	const vector<double>& constants = program.constantPool();
+	size_t rowCount = vars.rows();
+	size_t row = 0;
+
+#if defined(__AVX2__)
+	// programs deeper than the fixed vector stack (not seen in practice)
+	// simply take the scalar loop below
+	if (program.maxStackDepth() <= 64) {
+		__m256d stack[64];
+
+		for (; row + 4 <= rowCount; row += 4) {
+			int top = 0;
+			for (const Instruction& instr : code) {
+				switch (instr.op) {
+				case OpCode::PUSH_CONST:
+					stack[top++] = _mm256_set1_pd(constants[instr.operand]);
+					break;
+				case OpCode::LOAD_VAR:
+					stack[top++] = _mm256_loadu_pd(vars.column(instr.operand) + row);
+					break;
+				case OpCode::ADD:
+					--top;
+					stack[top - 1] = _mm256_add_pd(stack[top - 1], stack[top]);
+					break;
+				case OpCode::SUB:
+					--top;
+					stack[top - 1] = _mm256_sub_pd(stack[top - 1], stack[top]);
+					break;
+				case OpCode::MUL:
+					--top;
+					stack[top - 1] = _mm256_mul_pd(stack[top - 1], stack[top]);
+					break;
+				case OpCode::DIV:
+					--top;
+					stack[top - 1] = _mm256_div_pd(stack[top - 1], stack[top]);
+					break;
+				case OpCode::MOD: {
+					// no packed fmod exists; compute the four lanes scalar
+					--top;
+					double left[4], right[4];
+					_mm256_storeu_pd(left, stack[top - 1]);
+					_mm256_storeu_pd(right, stack[top]);
+					for (int lane = 0; lane < 4; ++lane) {
+						left[lane] = fmod(left[lane], right[lane]);
+					}
+					stack[top - 1] = _mm256_loadu_pd(left);
+					break;
+				}
+				case OpCode::NEG:
+					stack[top - 1] = _mm256_sub_pd(_mm256_setzero_pd(), stack[top - 1]);
+					break;
+				case OpCode::CALL_FN:
+					// sqrt, min and max have packed forms; the remaining
+					// registry functions run the four lanes scalar, like MOD
+					if (instr.operand == FUNC_SQRT) {
+						stack[top - 1] = _mm256_sqrt_pd(stack[top - 1]);
+					}
+					else if (instr.operand == FUNC_MIN) {
+						--top;
+						stack[top - 1] = _mm256_min_pd(stack[top - 1], stack[top]);
+					}
+					else if (instr.operand == FUNC_MAX) {
+						--top;
+						stack[top - 1] = _mm256_max_pd(stack[top - 1], stack[top]);
+					}
+					else if (functionTable[instr.operand].arity == 2) {
+						--top;
+						double left[4], right[4];
+						_mm256_storeu_pd(left, stack[top - 1]);
+						_mm256_storeu_pd(right, stack[top]);
+						for (int lane = 0; lane < 4; ++lane) {
+							left[lane] = functionTable[instr.operand].binary(left[lane], right[lane]);
+						}
+						stack[top - 1] = _mm256_loadu_pd(left);
+					}
+					else {
+						double lanes[4];
+						_mm256_storeu_pd(lanes, stack[top - 1]);
+						for (int lane = 0; lane < 4; ++lane) {
+							lanes[lane] = functionTable[instr.operand].unary(lanes[lane]);
+						}
+						stack[top - 1] = _mm256_loadu_pd(lanes);
+					}
+					break;
+				}
+			}
+			_mm256_storeu_pd(results + row, stack[0]);
+		}
+	}
+#endif
+
+	// remainder rows (and the whole batch without AVX2), with the same
+	// IEEE no-throw semantics
+	vector<double> stack(program.maxStackDepth());
+	for (; row < rowCount; ++row) {
+		int top = 0;
+		for (const Instruction& instr : code) {
+			switch (instr.op) {
+			case OpCode::PUSH_CONST:
+				stack[top++] = constants[instr.operand];
+				break;
+			case OpCode::LOAD_VAR:
+				stack[top++] = vars.column(instr.operand)[row];
+				break;
+			case OpCode::ADD:
+				--top;
+				stack[top - 1] += stack[top];
+				break;
+			case OpCode::SUB:
+				--top;
+				stack[top - 1] -= stack[top];
+				break;
+			case OpCode::MUL:
+				--top;
+				stack[top - 1] *= stack[top];
+				break;
+			case OpCode::DIV:
+				--top;
+				stack[top - 1] /= stack[top];
+				break;
+			case OpCode::MOD:
+				--top;
+				stack[top - 1] = fmod(stack[top - 1], stack[top]);
+				break;
+			case OpCode::NEG:
+				stack[top - 1] = -stack[top - 1];
+				break;
+			case OpCode::CALL_FN: {
+				// sqrt goes straight to the math library: the registered
+				// fnSqrt throws on negative input, which batch mode does not
+				const FunctionInfo& info = functionTable[instr.operand];
+				if (instr.operand == FUNC_SQRT) {
+					stack[top - 1] = sqrt(stack[top - 1]);
+				}
+				else if (info.arity == 2) {
+					--top;
+					stack[top - 1] = info.binary(stack[top - 1], stack[top]);
+				}
+				else {
+					stack[top - 1] = info.unary(stack[top - 1]);
+				}
+				break;
+			}
+			}
+		}
+		results[row] = stack[0];
+	}
+}
@@ -0,0 +1,324 @@
+// Contains a work-stealing driver for batch jobs spanning many expression
+// files of wildly different sizes. Every worker owns a deque of tasks and
+// steals from the others when its own runs dry, so one huge file no longer
+// pins the whole job to a single core. Tasks are either the preparation of a
+// file (mapping and splitting it, serialized per file because interning is
+// single-threaded) or a chunk of independent lines; 'let' lines act as
+// barriers within a file, exactly like in parallelBatch.h. Results are
+// buffered per line and written out per file in input order.
+#pragma once
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "checkedEval.h"
+#include "fastPath.h"
+#include "lineTokenizer.h"
+#include "mappedFile.h"
+#include "resultCache.h"
+#include "variable.h"
+
+using namespace std;
+
+// One input file being processed: its mapping, lines, per-line results, and
+// the cursor of the segment currently scheduled. Each file is an independent
+// session with its own variable table, mirroring the one-process-per-file
+// setup this replaces.
+class FileJob {
+public:
+	string path;
+	unique_ptr<MappedFile> file;
+	vector<string_view> lines;
+
+	// marks barrier lines: anything containing the word 'let' is evaluated
+	// alone between parallel segments
+	vector<char> isBarrier;
+
+	VarTable varTable;
+	vector<string> results;
+
+	// file-level failure (e.g. the file cannot be opened)
+	string error;
+
+	// chunks of the current segment still outstanding
+	atomic<size_t> remaining{ 0 };
+	size_t segmentStart = 0;
+	size_t segmentEnd = 0;
+};
+
+// A unit of work: preparing a file, or evaluating lines [begin, end) of an
+// already prepared one
+class BatchTask {
+public:
+	enum class Kind { PREPARE, CHUNK };
+
+	Kind kind;
+	int job;
+	size_t begin;
+	size_t end;
+};
+
+// The pool itself: per-worker deques, chunked scheduling with let-barriers,
+// and per-worker result caches
+class MultiFileScheduler {
+private:
+	static const size_t chunkSize = 64;
+
+	// per-worker scratch state; the cache is worker-local so lookups never
+	// contend
+	class WorkerState {
+	public:
+		ResultCache cache{ 10000 };
+		string cacheKey;
+	};
+
+	vector<unique_ptr<FileJob>> jobs;
+	vector<deque<BatchTask>> queues;
+	vector<unique_ptr<mutex>> queueLocks;
+	vector<WorkerState> workerStates;
+	atomic<int> jobsRemaining{ 0 };
+
+	// Returns whether the line contains the word 'let' anywhere; such lines
+	// may define a variable and must run alone as a barrier
+	static bool containsLet(string_view line) {
+		for (size_t i = 0; i + 3 <= line.size(); ++i) {
+			if (line[i] == 'l' && line[i + 1] == 'e' && line[i + 2] == 't'
+					&& (i == 0 || !isalnum(static_cast<unsigned char>(line[i - 1])))
+					&& (i + 3 == line.size()
+						|| !isalnum(static_cast<unsigned char>(line[i + 3])))) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void push(int worker, BatchTask task) {
+		lock_guard<mutex> guard(*queueLocks[worker]);
+		queues[worker].push_back(task);
+	}
+
+	// Pops from the worker's own queue, stealing from the other end of a
+	// victim's queue when it is empty
+	bool pop(int worker, BatchTask& task) {
+		{
+			lock_guard<mutex> guard(*queueLocks[worker]);
+			if (!queues[worker].empty()) {
+				task = queues[worker].back();
+				queues[worker].pop_back();
+				return true;
+			}
+		}
+
+		for (size_t victim = 0; victim < queues.size(); ++victim) {
+			if (static_cast<int>(victim) == worker) {
+				continue;
+			}
+			lock_guard<mutex> guard(*queueLocks[victim]);
+			if (!queues[victim].empty()) {
+				task = queues[victim].front();
+				queues[victim].pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Maps the file, splits it into lines, warms the interner with every
+	// name in the file (so chunk evaluation never mutates it concurrently),
+	// and schedules the first segment
+	void prepare(int jobIndex, int worker) {
+		FileJob& job = *jobs[jobIndex];
+		try {
+			job.file = make_unique<MappedFile>(job.path);
+		}
+		catch (runtime_error& e) {
+			job.error = e.what();
+			--jobsRemaining;
+			return;
+		}
+
+		MappedLineReader reader{ *job.file };
+		string_view line;
+		while (reader.next(line)) {
+			job.lines.push_back(line);
+			job.isBarrier.push_back(containsLet(line) ? 1 : 0);
+		}
+		job.results.resize(job.lines.size());
+
+		// every session starts with the same constants main() defines
+		job.varTable.define("pi", 3.1415926535);
+		job.varTable.define("e", 2.7182818284);
+
+		// intern every alphanumeric run up front; chunk workers then only
+		// ever read the interner (the scan may intern a few non-names, e.g.
+		// exponent suffixes, which is harmless)
+		NameInterner& interner = job.varTable.getInterner();
+		for (string_view scanned : job.lines) {
+			size_t i = 0;
+			while (i < scanned.size()) {
+				if (isalpha(static_cast<unsigned char>(scanned[i]))) {
+					size_t start = i;
+					while (i < scanned.size()
+							&& isalnum(static_cast<unsigned char>(scanned[i]))) {
+						++i;
+					}
+					interner.intern(scanned.substr(start, i - start));
+				}
+				else {
+					++i;
+				}
+			}
+		}
+
+		advance(jobIndex, worker);
+	}
+
+	// Evaluates one line through the exception-free path, memoizing through
+	// the worker's cache, and stores its printable result
+	void evaluateLine(FileJob& job, size_t index, WorkerState& state) {
+		string_view line = job.lines[index];
+		double value;
+		bool cacheable = buildCacheKey(line, job.varTable, state.cacheKey);
+
+		if (!cacheable || !state.cache.lookup(state.cacheKey, value)) {
+			LineTokenizer tokenizer{ line, job.varTable.getInterner() };
+			if (!tryFastPath(tokenizer, job.varTable, value)) {
+				tokenizer.reset(line);
+				EvalResult result = CheckedEvaluator{ tokenizer, job.varTable }.run();
+				if (!result.hasValue()) {
+					job.results[index] = string(describeEvalError(result.error))
+						+ " (column " + to_string(result.position + 1) + ")";
+					return;
+				}
+				value = result.value;
+			}
+			if (cacheable) {
+				state.cache.insert(state.cacheKey, value);
+			}
+		}
+
+		char formatted[32];
+		int length = snprintf(formatted, sizeof(formatted), "= %g", value);
+		job.results[index].assign(formatted, length);
+	}
+
+	// Moves the job forward: barrier lines run inline one by one, the next
+	// run of independent lines is chunked onto this worker's queue, and a
+	// job with no lines left is retired
+	void advance(int jobIndex, int worker) {
+		FileJob& job = *jobs[jobIndex];
+		while (true) {
+			if (job.segmentStart >= job.lines.size()) {
+				--jobsRemaining;
+				return;
+			}
+
+			if (job.isBarrier[job.segmentStart]) {
+				evaluateLine(job, job.segmentStart, workerStates[worker]);
+				++job.segmentStart;
+				continue;
+			}
+
+			size_t end = job.segmentStart;
+			while (end < job.lines.size() && !job.isBarrier[end]) {
+				++end;
+			}
+			job.segmentEnd = end;
+			job.remaining = (end - job.segmentStart + chunkSize - 1) / chunkSize;
+
+			for (size_t begin = job.segmentStart; begin < end; begin += chunkSize) {
+				push(worker, BatchTask{ BatchTask::Kind::CHUNK, jobIndex,
+					begin, min(begin + chunkSize, end) });
+			}
+			return;
+		}
+	}
+
+	void run(const BatchTask& task, int worker) {
+		if (task.kind == BatchTask::Kind::PREPARE) {
+			prepare(task.job, worker);
+			return;
+		}
+
+		FileJob& job = *jobs[task.job];
+		for (size_t i = task.begin; i < task.end; ++i) {
+			evaluateLine(job, i, workerStates[worker]);
+		}
+
+		// the worker completing the last chunk of a segment drives the job
+		// past the next barrier
+		if (job.remaining.fetch_sub(1) == 1) {
+			job.segmentStart = job.segmentEnd;
+			advance(task.job, worker);
+		}
+	}
+
+	void workerLoop(int worker) {
+		BatchTask task;
+		while (jobsRemaining.load() > 0) {
+			if (pop(worker, task)) {
+				run(task, worker);
+			}
+			else {
+				this_thread::yield();
+			}
+		}
+	}
+
+public:
+	// Processes all files and writes their results to the output, one block
+	// per file in input order
+	void runAll(const vector<string>& paths, ostream& output, unsigned threadCount) {
+		if (threadCount < 1) {
+			threadCount = 1;
+		}
+		queues.resize(threadCount);
+		for (unsigned i = 0; i < threadCount; ++i) {
+			queueLocks.push_back(make_unique<mutex>());
+		}
+		workerStates.resize(threadCount);
+
+		jobsRemaining = static_cast<int>(paths.size());
+		for (size_t i = 0; i < paths.size(); ++i) {
+			jobs.push_back(make_unique<FileJob>());
+			jobs.back()->path = paths[i];
+			push(static_cast<int>(i % threadCount),
+				BatchTask{ BatchTask::Kind::PREPARE, static_cast<int>(i), 0, 0 });
+		}
+
+		vector<thread> workers;
+		for (unsigned i = 1; i < threadCount; ++i) {
+			workers.emplace_back([this, i] { workerLoop(static_cast<int>(i)); });
+		}
+		workerLoop(0);
+		for (thread& t : workers) {
+			t.join();
+		}
+
+		for (const unique_ptr<FileJob>& job : jobs) {
+			output << "=== " << job->path << " ===" << '\n';
+			if (!job->error.empty()) {
+				output << job->error << '\n';
+				continue;
+			}
+			for (const string& result : job->results) {
+				output << result << '\n';
+			}
+		}
+		output.flush();
+	}
+};
+
+// Evaluates every given file as its own session and writes one result block
+// per file, spreading the work over threadCount stealing workers
+inline void runMultiFileBatch(const vector<string>& paths, ostream& output,
+		unsigned threadCount) {
+	MultiFileScheduler{}.runAll(paths, output, threadCount);
+}